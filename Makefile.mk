@@ -42,6 +42,11 @@ INCLUDE_PATH         += -I/opt/wine-staging/include
 INCLUDE_PATH         += -I/opt/wine-staging/include/wine/windows
 LIBRARIES             = $(shell pkg-config --libs jack)
 
+# USDT probes for perf and bpftrace, when systemtap's sys/sdt.h is installed
+ifeq ($(shell $(CC) -m$(M) -include sys/sdt.h -E -x c /dev/null >/dev/null 2>&1 && echo yes),yes)
+CEXTRA               += -DHAVE_SYS_SDT_H
+endif
+
 # 64bit build needs an extra flag
 ifeq ($(M),64)
 CEXTRA               += -DNATIVE_INT64
@@ -25,12 +25,19 @@
  */
 
 #include <sched.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <jack/jack.h>
 #include <jack/thread.h>
 #include <signal.h>
@@ -39,10 +46,23 @@
 #include "wine/debug.h"
 #else
 #define TRACE(...) {}
-#define WARN(fmt, ...) {} fprintf(stdout, fmt, ##__VA_ARGS__)
-#define ERR(fmt, ...) {} fprintf(stderr, fmt, ##__VA_ARGS__)
+#define WARN(...) LOG(LogDriver, LogWarn, __VA_ARGS__)
+#define ERR(...) LOG(LogDriver, LogError, __VA_ARGS__)
 #endif
 
+/* LOG prints right away and may block, LOG_RT only queues up to LOG_ARGUMENTS integers for the log thread */
+#define LOG(category, level, ...) do { \
+        if (__atomic_load_n(&logger.levels[category], __ATOMIC_RELAXED) >= (level)) \
+            log_print(level, __VA_ARGS__); \
+    } while (0)
+#define LOG_RT(category, level, format, ...) do { \
+        if (__atomic_load_n(&logger.levels[category], __ATOMIC_RELAXED) >= (level)) \
+        { \
+            if (0) printf(format, ##__VA_ARGS__); \
+            log_record(level, format, (const LONG [LOG_ARGUMENTS]) { __VA_ARGS__ }); \
+        } \
+    } while (0)
+
 #include "objbase.h"
 #include "mmsystem.h"
 #include "winreg.h"
@@ -59,11 +79,70 @@
 WINE_DEFAULT_DEBUG_CHANNEL(asio);
 #endif
 
+/* USDT probes of the wineasio provider for perf and bpftrace, a nop unless something is attached */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(wineasio, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
 #define MAX_ENVIRONMENT_SIZE        6
+#define MAX_ROUTING_LENGTH          1024
 #define ASIO_MAX_NAME_LENGTH        32
 #define ASIO_MINIMUM_BUFFERSIZE     16
 #define ASIO_MAXIMUM_BUFFERSIZE     8192
 #define ASIO_PREFERRED_BUFFERSIZE   1024
+#define ASIO_GAIN_UNITY             0x20000000
+
+/* polyphase windowed sinc resampler, taps must be a multiple of 4 for the SIMD dot product */
+#define RESAMPLER_TAPS              64
+#define RESAMPLER_PHASES            256
+#define RESAMPLER_KAISER_BETA       9.0
+#define RESAMPLER_MAXIMUM_RATIO     4.0
+
+/* log-linear timing histograms, four buckets per power of two nanoseconds up to about 4 seconds */
+#define HISTOGRAM_BUCKETS           124
+
+/* cycle costs are averaged over about 64 cycles, maxima are those of the last window */
+#define COST_AVERAGE_SHIFT          6
+#define COST_WINDOW                 1024
+
+/* keeps what the real-time threads write off the lines the other threads use */
+#define CACHE_LINE_SIZE             64
+#define CACHE_ALIGNED               __attribute__ ((aligned (CACHE_LINE_SIZE)))
+
+/* bandwidth in Hz of the delay-locked loop on the cycle times */
+#define CLOCK_BANDWIDTH             0.5
+
+/* Wine bases QueryPerformanceCounter() and timeGetTime() on the raw monotonic clock */
+#ifdef CLOCK_MONOTONIC_RAW
+#define SYSTEM_CLOCK                CLOCK_MONOTONIC_RAW
+#else
+#define SYSTEM_CLOCK                CLOCK_MONOTONIC
+#endif
+
+/* highest JACK port number a route may name */
+#define ROUTING_MAXIMUM_PORTS       256
+
+/* live statistics published under /dev/shm, the version changes with the layout */
+#define SHARED_STATISTICS_MAGIC     0x4f495341 /* "ASIO" */
+#define SHARED_STATISTICS_VERSION   3
+#define SHARED_STATISTICS_PATH      "/dev/shm/wineasio-%i-%s"
+
+/* opt-in timeline of the driver threads, one ring of events per thread, a power of two */
+#define TRACE_THREADS               16
+#define TRACE_RING_EVENTS           8192
+#define TRACE_FLUSH_INTERVAL        100
+
+/* log rings of the audio threads */
+#define LOG_THREADS                 16
+#define LOG_RING_RECORDS            256
+#define LOG_ARGUMENTS               4
+#define MAX_LOG_LENGTH              256
+
+typedef float v4sf __attribute__ ((vector_size (16)));
+typedef int v4si __attribute__ ((vector_size (16)));
 
 /* ASIO drivers (breaking the COM specification) use the Microsoft variety of
  * thiscall calling convention which gcc is unable to produce.  These macros
@@ -144,8 +223,285 @@ typedef struct IOChannel
     jack_default_audio_sample_t *audio_buffer;
     char                        port_name[ASIO_MAX_NAME_LENGTH];
     jack_port_t                 *port;
+    jack_default_audio_sample_t *port_buffer;
+
+    /* driver side gain and meters, gain_target is set by the host and read by the JACK thread,
+     * the meters are written by the JACK thread and read back by the host, in ASIO units */
+    LONG                        gain_target;
+    float                       gain;
+    BOOL                        metered;
+    LONG                        meter_peak;
+    LONG                        meter_rms;
+    struct SharedMeter          *shared_meter;
+
+    /* direct monitoring of an input into the output pair starting at monitor_output, -1 when off */
+    LONG                        monitor_output;
+    LONG                        monitor_gain;
+    LONG                        monitor_pan;
 } IOChannel;
 
+/* Single producer, single consumer ring of planar audio, one lane per channel.
+ * The positions are free running frame counters, only the owner writes its own. */
+typedef struct AudioRing
+{
+    jack_default_audio_sample_t *buffer;
+    int                         channels;
+    unsigned int                size;
+    unsigned int                read_pos;
+    unsigned int                write_pos;
+} AudioRing;
+
+/* Streaming sample rate converter for a group of channels sharing one read position.
+ * Input is appended to a per channel history, output is interpolated from the polyphase kernel. */
+typedef struct Resampler
+{
+    int                         channels;
+    double                      step;
+    double                      position;
+    unsigned int                fill;
+    unsigned int                capacity;
+    jack_default_audio_sample_t *history;
+    float                       *kernel;
+} Resampler;
+
+/* A frame position and its system time under a sequence lock, odd while a write is in progress.
+ * Each one has a single writer, readers retry until they got both values of the same write. */
+typedef struct PositionSnapshot
+{
+    LONG                        sequence;
+    unsigned long long          position;
+    unsigned long long          system_time;
+} PositionSnapshot;
+
+/* How ASIO buffers are fed from JACK periods, rebuilt whenever either size or rate changes */
+typedef struct PeriodAdapter
+{
+    INT                         mode;
+    LONG                        jack_buffersize;
+    LONG                        asio_buffersize;
+    LONG                        slices;
+    /* ASIO frames the adapter delays each direction by, the output side also holds the host's headroom */
+    LONG                        input_latency;
+    LONG                        output_latency;
+    /* the host runs on the asynchronous thread, never within a JACK cycle */
+    BOOL                        threaded;
+    AudioRing                   input_ring;
+    AudioRing                   output_ring;
+    /* input ring write position where the latest JACK period starts, and the time of its first sample */
+    PositionSnapshot            input_stamp;
+
+    /* only used when the ASIO sample rate differs from the JACK one */
+    BOOL                        resampling;
+    Resampler                   input_resampler;
+    Resampler                   output_resampler;
+    jack_default_audio_sample_t *resampler_scratch;
+    unsigned int                resampler_scratch_frames;
+} PeriodAdapter;
+
+enum { AdapterSlice, AdapterRing };
+
+/* Durations in nanoseconds, bucket 4 * (e - 1) + m counts values from (4 + m) << (e - 2) on.
+ * Each histogram has a single writer, so buckets are plain relaxed stores. */
+typedef struct Histogram
+{
+    LONG                        count[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/* what each cycle histogram measures */
+enum
+{
+    TimingWake,         /* JACK entered the process callback until the processing thread woke */
+    TimingInput,        /* wake until the first bufferSwitch */
+    TimingHost,         /* each bufferSwitch */
+    TimingOutput,       /* last bufferSwitch until the JACK thread was released */
+    TimingCycle,        /* the whole cycle */
+    TimingCount
+};
+
+/* Rolling cost of one part of the cycle in nanoseconds, wall clock and CPU time of the processing thread */
+typedef struct CycleCost
+{
+    LONG                        wall_average;
+    LONG                        wall_maximum;
+    LONG                        cpu_average;
+    LONG                        cpu_maximum;
+    LONG                        wall_window_maximum;
+    LONG                        cpu_window_maximum;
+} CycleCost;
+
+/* parts of a cycle, they add up to CostCycle */
+enum
+{
+    CostWake,           /* handoff to the processing thread, no CPU time of its own */
+    CostInput,          /* input copies and conversion up to the first bufferSwitch */
+    CostHost,           /* all bufferSwitch calls of the cycle */
+    CostOutput,         /* output copies, mixing and signalling JACK back */
+    CostCycle,
+    CostCount
+};
+
+/* counters of the processing thread read around every bufferSwitch, one perf event group */
+enum
+{
+    CounterCycles,
+    CounterInstructions,
+    CounterCacheMisses,
+    CounterMinorFaults,
+    CounterCount
+};
+
+/* Timing accounting of one driver instance, updated from the JACK threads without locks */
+typedef struct Statistics
+{
+    LONG                        xruns;              /* reported by JACK */
+    LONG                        missed_deadlines;   /* cycles that took longer than the JACK period */
+    LONG                        late_callbacks;     /* JACK periods the host had not delivered in time */
+    LONG                        discontinuities;    /* jumps of the JACK timeline the host was asked to resync to */
+    unsigned long long          discontinuity_position; /* ASIO sample position right after the last jump */
+    Histogram                   timing[TimingCount];
+    CycleCost                   cost[CostCount];
+    LONG                        cost_cycles;
+    LONG                        period_budget;      /* nanoseconds in a JACK period */
+    unsigned long long          counter_driver[CounterCount];   /* totals outside of bufferSwitch, */
+    unsigned long long          counter_host[CounterCount];     /* inside it, zero when not counted */
+    unsigned long long          counted_cycles;
+    LONG                        clock_rate;         /* JACK sample rate measured against the monotonic clock, in mHz */
+    LONG                        clock_drift;        /* parts per billion it runs fast of the nominal rate */
+} Statistics;
+
+/* Meters of one channel as seen by a statistics reader, which may zero the peak after reading it */
+typedef struct SharedMeter
+{
+    LONG                        active;
+    LONG                        peak;
+    LONG                        rms;
+} SharedMeter;
+
+/* Block published per driver instance for monitoring tools. The driver is the only writer apart
+ * from metering and the meter peaks, fields are stored with relaxed atomics and never locked.
+ * The layout is the same for 32 and 64 bit builds, readers check magic and version and find the
+ * statistics and the meters (inputs including loopbacks, then outputs) at their offsets. */
+typedef struct SharedStatistics
+{
+    DWORD                       magic;
+    DWORD                       version;
+    DWORD                       size;
+    DWORD                       statistics_offset;
+    DWORD                       meter_offset;
+    LONG                        pid;
+    char                        client_name[ASIO_MAX_NAME_LENGTH];
+    LONG                        state;
+    LONG                        asio_buffersize;
+    LONG                        jack_buffersize;
+    LONG                        asio_sample_rate;
+    LONG                        jack_sample_rate;
+    LONG                        num_inputs;
+    LONG                        num_outputs;
+    LONG                        active_inputs;
+    LONG                        active_outputs;
+    LONG                        metering;           /* set by a reader to have every channel metered */
+    unsigned long long          cycles;             /* JACK cycles processed, a heartbeat */
+    unsigned long long          sample_position;
+    Statistics                  statistics;
+    SharedMeter                 meter[];
+} SharedStatistics;
+
+/* One point of the timeline, phase is that of the Chrome trace format, B and E around a span or i */
+typedef struct TraceEvent
+{
+    unsigned long long          time;               /* monotonic nanoseconds */
+    const char                  *name;
+    const char                  *arg_name;          /* NULL without an argument */
+    LONG                        arg;
+    char                        phase;
+} TraceEvent;
+
+/* Events of a single thread, written by that thread only and drained by the flush thread */
+typedef struct TraceRing
+{
+    BOOL                        claimed;
+    int                         tid;
+    BOOL                        named;
+    unsigned int                read_pos;
+    unsigned int                write_pos;
+    LONG                        dropped;
+    TraceEvent                  events[TRACE_RING_EVENTS];
+} TraceRing;
+
+/* All of it is allocated up front, a thread claims its ring with its first event */
+typedef struct Trace
+{
+    FILE                        *file;
+    LONG                        generation;
+    LONG                        num_rings;
+    HANDLE                      thread;
+    BOOL                        running;
+    TraceRing                   rings[TRACE_THREADS];
+} Trace;
+
+/* levels and categories of the log, a message shows when its level is at most that of its category */
+enum { LogNone, LogError, LogWarn, LogInfo, LogDebug };
+enum { LogDriver, LogAudio, LogEvents, LogDiagnostics, LogCategoryCount };
+
+/* A message of an audio thread, formatted by the log thread */
+typedef struct LogRecord
+{
+    unsigned long long          time;               /* monotonic nanoseconds, orders the rings */
+    const char                  *format;            /* a string literal */
+    LONG                        level;
+    LONG                        args[LOG_ARGUMENTS];
+} LogRecord;
+
+enum { LogRingFree, LogRingOwned };
+
+/* Messages of a single thread, written by that thread only, the log thread frees it once the thread is gone */
+typedef struct LogRing
+{
+    LONG                        state;
+    int                         tid;                /* 0 until the owner has stored it */
+    unsigned int                read_pos;
+    unsigned int                write_pos;
+    LONG                        dropped;
+    LONG                        reported;
+    LogRecord                   records[LOG_RING_RECORDS];
+} LogRing;
+
+/* One per process, the levels are set by every Init() and the thread runs while a driver is initialized */
+typedef struct Logger
+{
+    LONG                        levels[LogCategoryCount];
+    LONG                        users;
+    HANDLE                      thread;
+    BOOL                        running;
+    BOOL                        semaphore_ready;
+    sem_t                       semaphore;
+    LONG                        unclaimed;          /* messages of threads beyond LOG_THREADS */
+    LONG                        unclaimed_reported;
+    LogRing                     rings[LOG_THREADS];
+} Logger;
+
+/* One cell of the routing matrix, adds an ASIO channel into a JACK port (outputs)
+ * or a JACK port into an ASIO channel (inputs) */
+typedef struct RoutingEntry
+{
+    int                         channel;
+    int                         port;
+    float                       gain;
+} RoutingEntry;
+
+/* Sparse matrix replacing the default of one JACK port per ASIO channel.
+ * The routed channels process into scratch, which is mixed to or from the ports every cycle. */
+typedef struct Routing
+{
+    int                         num_ports;
+    jack_port_t                 **ports;
+    int                         *port_numbers;  /* the N of in_N or out_N, only ports named by a route exist */
+    jack_default_audio_sample_t **port_buffers;
+    int                         num_entries;
+    RoutingEntry                *entries;
+    jack_default_audio_sample_t *scratch;
+} Routing;
+
 typedef struct IWineASIOImpl
 {
     /* COM stuff */
@@ -158,29 +514,43 @@ typedef struct IWineASIOImpl
     /* ASIO stuff */
     LONG                        asio_active_inputs;
     LONG                        asio_active_outputs;
-    BOOL                        asio_buffer_index;
     ASIOCallbacks               *asio_callbacks;
+    BOOL                        asio_can_buffer_size_change;
+    BOOL                        asio_can_latencies_changed;
+    BOOL                        asio_can_overload;
+    BOOL                        asio_can_reset_request;
+    BOOL                        asio_can_resync_request;
     BOOL                        asio_can_time_code;
     LONG                        asio_current_buffersize;
     INT                         asio_driver_state;
-    ASIOSamples                 asio_sample_position;
     ASIOSampleRate              asio_sample_rate;
-    ASIOTime                    asio_time;
     BOOL                        asio_time_info_mode;
-    ASIOTimeStamp               asio_time_stamp;
     LONG                        asio_version;
 
     /* WineASIO configuration options */
     LONG                        wineasio_number_inputs;
+    LONG                        wineasio_number_loopbacks;
+    LONG                        wineasio_loopback_source;
     LONG                        wineasio_number_outputs;
     BOOL                        wineasio_autostart_server;
     BOOL                        wineasio_connect_to_hardware;
     LONG                        wineasio_fixed_buffersize;
     LONG                        wineasio_preferred_buffersize;
+    BOOL                        wineasio_decoupled_buffersize;
+    LONG                        wineasio_async_periods;
+    BOOL                        wineasio_resampling;
+    BOOL                        wineasio_performance_counters;
+    BOOL                        wineasio_interpolate_position;
+    char                        wineasio_input_routing[MAX_ROUTING_LENGTH];
+    char                        wineasio_output_routing[MAX_ROUTING_LENGTH];
+    char                        wineasio_trace_file[MAX_PATH];
+    char                        wineasio_log_level[MAX_LOG_LENGTH];
 
     /* JACK stuff */
     jack_client_t               *jack_client;
     char                        jack_client_name[ASIO_MAX_NAME_LENGTH];
+    LONG                        jack_buffersize;
+    jack_nframes_t              jack_sample_rate;
     int                         jack_num_input_ports;
     int                         jack_num_output_ports;
     const char                  **jack_input_ports;
@@ -190,10 +560,138 @@ typedef struct IWineASIOImpl
     jack_default_audio_sample_t *callback_audio_buffer;
     IOChannel                   *input_channel;
     IOChannel                   *output_channel;
+    PeriodAdapter               *period_adapter;
+    Routing                     *input_routing;
+    Routing                     *output_routing;
+
+    /* the host runs on its own thread one or more periods behind JACK, in asynchronous mode
+     * and for ASIO buffers longer than a JACK period */
+    HANDLE                      async_thread;
+    DWORD                       async_thread_id;
+    sem_t                       async_semaphore;
+    BOOL                        async_running;
+    BOOL                        async_busy;
+
+    /* Adapters for a new JACK period are built off the real-time thread and handed over through
+     * pending_adapter, the JACK thread swaps them in between cycles and gives back the old one */
+    pthread_mutex_t             adapter_lock;
+    PeriodAdapter               *pending_adapter;
+    PeriodAdapter               *retired_adapter;
+    BOOL                        adapter_reset_pending;
+    /* JACK frames the adapter delays captured and played audio by, published to the graph */
+    jack_nframes_t              adapter_input_latency;
+    jack_nframes_t              adapter_output_latency;
+
+    /* sample position of the last buffer, read by hosts polling GetSamplePosition(), on a line of its own */
+    PositionSnapshot            position CACHE_ALIGNED;
+
+    /* Everything below up to the event thread is written by the thread running the host every buffer,
+     * or by the JACK thread every cycle, and starts on a line of its own */
+    BOOL                        asio_buffer_index CACHE_ALIGNED;
+    ASIOSamples                 asio_sample_position;
+    /* ASIO frames lost to a JACK timeline jump, added to the position by the thread running the host */
+    unsigned long long          asio_sample_jump;
+    ASIOTime                    asio_time;
+    ASIOTimeStamp               asio_time_stamp;
+
+    /* set while the host runs the last ASIO buffer of a JACK cycle, OutputReady() may then
+     * hand the outputs to JACK and finish the cycle before bufferSwitch returns */
+    BOOL                        output_ready_armed;
+    BOOL                        output_ready_done;
+    jack_nframes_t              output_ready_nframes;
+
+    /* timing of the current JACK cycle, to notice lost cycles and overruns */
+    Statistics                  *statistics;
+    jack_time_t                 cycle_start;
+    jack_nframes_t              cycle_frame_time;
+    jack_nframes_t              cycle_nframes;
+    BOOL                        cycle_frame_time_valid;
+
+    /* JACK transport as the time code of the ASIO buffers. The sync callback hands over where the transport
+     * was located as a count in the high half and the frame in the low one, the JACK thread counts on from
+     * there while it rolls and only queries the whole position after lost cycles */
+    unsigned long long          transport_locate;
+    LONG                        transport_located;  /* the count last taken over */
+    jack_nframes_t              transport_frame;    /* at the start of the cycle */
+    jack_nframes_t              transport_nframes;
+    BOOL                        transport_rolling;
+    BOOL                        transport_resync;
+
+    /* second order delay-locked loop on the cycle start times, which smooths them and measures the period,
+     * the doubles count nanoseconds from clock_origin, which follows clock_t0 */
+    BOOL                        clock_valid;
+    unsigned long long          clock_origin;
+    double                      clock_t0;           /* start of the current cycle */
+    double                      clock_t1;           /* predicted start of the next one */
+    double                      clock_period;
+    double                      clock_b;
+    double                      clock_c;
+    jack_nframes_t              clock_nframes;
+    jack_nframes_t              clock_sample_rate;
+
+    /* monotonic timestamps of the current cycle in nanoseconds, switch_enter is 0 until the host runs */
+    unsigned long long          timing_start;
+    unsigned long long          timing_wake;
+    unsigned long long          timing_switch_enter;
+    unsigned long long          timing_switch_exit;
+    unsigned long long          timing_wake_cpu;
+    unsigned long long          timing_switch_enter_cpu;
+    unsigned long long          timing_host;
+    unsigned long long          timing_host_cpu;
+    unsigned long long          timing_call;
+    unsigned long long          timing_call_cpu;
+
+    /* Performance counters of the processing thread. The event thread opens them once the JACK thread
+     * posts its thread id in perf_request_tid, perf_tid is that of the open group or 0. */
+    int                         perf_fd[CounterCount];
+    int                         perf_slot[CounterCount];    /* position in the group read, -1 when not counted */
+    int                         perf_group;                 /* the leader of perf_fd */
+    int                         perf_members;
+    int                         perf_tid;
+    int                         perf_request_tid;
+    BOOL                        perf_active;                /* the counters are read this cycle */
+    unsigned long long          perf_start[CounterCount];
+    unsigned long long          perf_call[CounterCount];
+    unsigned long long          perf_host[CounterCount];
+
+    /* non real-time thread for the work the JACK callbacks must not do themselves,
+     * including every call into the host outside of bufferSwitch */
+    HANDLE                      event_thread CACHE_ALIGNED;
+    DWORD                       event_thread_id;
+    sem_t                       event_semaphore;
+    BOOL                        event_running;
+    LONG                        event_pending;
+    /* an event thread that disposed the buffers from within a message cannot be joined right away */
+    HANDLE                      event_thread_retired;
+    DWORD                       event_thread_retired_id;
+
+    /* statistics block, mapped from shared_path or on the heap when that is empty */
+    SharedStatistics            *shared;
+    char                        shared_path[64];
+    size_t                      shared_size;
+    BOOL                        shared_metering;
+
+    /* timeline of the driver threads, NULL unless a trace file is configured */
+    Trace                       *trace;
 } IWineASIOImpl;
 
 enum { Loaded, Initialized, Prepared, Running };
 
+/* event_pending bits, repeated events merge until the event thread gets to them */
+enum
+{
+    EventJackBufferSize     = 1 << 0,   /* rebuild the period adapter for the new JACK period */
+    EventBufferSizeChange   = 1 << 1,   /* host messages */
+    EventResetRequest       = 1 << 2,
+    EventLatenciesChanged   = 1 << 3,
+    EventSampleRateChange   = 1 << 4,
+    EventResync             = 1 << 5,   /* the JACK timeline jumped */
+    EventOverload           = 1 << 6,   /* a cycle or the host ran late */
+    EventPerfCounters       = 1 << 7,   /* open the performance counters for perf_request_tid */
+    EventJackSampleRate     = 1 << 8,   /* rebuild the period adapter for the new JACK rate */
+    EventHostSampleRate     = 1 << 9    /* rebuild it for the rate a running host switched to */
+};
+
 /****************************************************************************
  *  Interface Methods
  */
@@ -259,8 +757,12 @@ HIDDEN void __thiscall_OutputReady(void);
 
 static inline int  jack_buffer_size_callback (jack_nframes_t nframes, void *arg);
 static inline void jack_latency_callback(jack_latency_callback_mode_t mode, void *arg);
+static inline int jack_port_count(IWineASIOImpl *This, BOOL input);
+static inline jack_port_t *jack_port_at(IWineASIOImpl *This, BOOL input, int i);
 static inline int  jack_process_callback (jack_nframes_t nframes, void *arg);
 static inline int  jack_sample_rate_callback (jack_nframes_t nframes, void *arg);
+static inline int  jack_xrun_callback (void *arg);
+static inline int  jack_sync_callback (jack_transport_state_t state, jack_position_t *position, void *arg);
 
 /*
  *  Support functions
@@ -269,7 +771,76 @@ static inline int  jack_sample_rate_callback (jack_nframes_t nframes, void *arg)
 HRESULT WINAPI  WineASIOCreateInstance(REFIID riid, LPVOID *ppobj);
 static  VOID    configure_driver(IWineASIOImpl *This);
 
+static  BOOL            audio_ring_alloc(AudioRing *ring, int channels, unsigned int frames);
+static  void            audio_ring_free(AudioRing *ring);
+static  void            audio_ring_reset(AudioRing *ring);
+static inline unsigned int audio_ring_readable(AudioRing *ring);
+static inline unsigned int audio_ring_writable(AudioRing *ring);
+static inline void      audio_ring_read(AudioRing *ring, int channel, jack_default_audio_sample_t *dst, unsigned int frames, IOChannel *io);
+static inline void      audio_ring_write(AudioRing *ring, int channel, const jack_default_audio_sample_t *src, unsigned int frames, IOChannel *io);
+static inline void      audio_ring_read_advance(AudioRing *ring, unsigned int frames);
+static inline void      audio_ring_write_advance(AudioRing *ring, unsigned int frames);
+static inline void      channel_copy(IOChannel *channel, jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, unsigned int frames);
+static inline void      channel_copy_split(IOChannel *channel, jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src,
+                                           unsigned int first, jack_default_audio_sample_t *dst2, const jack_default_audio_sample_t *src2,
+                                           unsigned int frames);
+static inline void      channel_mix(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, unsigned int frames);
+static  IOChannel       *channel_from_controls(IWineASIOImpl *This, ASIOChannelControls *controls, BOOL input);
+static  BOOL            resampler_init(Resampler *rs, int channels, double step, unsigned int max_input);
+static  void            resampler_free(Resampler *rs);
+static  void            resampler_reset(Resampler *rs);
+static inline unsigned int resampler_input_needed(Resampler *rs, unsigned int outputs);
+static inline unsigned int resampler_outputs_available(Resampler *rs);
+static inline jack_default_audio_sample_t *resampler_input(Resampler *rs, int channel);
+static inline void      resampler_input_advance(Resampler *rs, unsigned int frames);
+static inline void      resampler_run(Resampler *rs, int channel, jack_default_audio_sample_t *out, unsigned int outputs);
+static inline void      resampler_advance(Resampler *rs, unsigned int outputs);
+static  PeriodAdapter   *period_adapter_create(IWineASIOImpl *This, LONG jack_buffersize, LONG asio_buffersize);
+static  void            period_adapter_destroy(PeriodAdapter *adapter);
+static  void            period_adapter_reset(PeriodAdapter *adapter);
+static  BOOL            period_adapter_replace(IWineASIOImpl *This, LONG jack_buffersize);
+static  BOOL            period_adapter_publish_latency(IWineASIOImpl *This, PeriodAdapter *adapter);
+static inline void      post_event(IWineASIOImpl *This, LONG event);
+static inline void      snapshot_publish(PositionSnapshot *snapshot, unsigned long long position, unsigned long long system_time);
+static inline void      snapshot_read(PositionSnapshot *snapshot, unsigned long long *position, unsigned long long *system_time);
+static inline void      transport_update(IWineASIOImpl *This, jack_nframes_t nframes);
+static inline void      transport_time_code(IWineASIOImpl *This, LONG offset);
+static inline void      period_adapter_slice_output(IWineASIOImpl *This, LONG offset);
+static inline void      period_adapter_ring_write(IWineASIOImpl *This, PeriodAdapter *adapter);
+static inline void      period_adapter_ring_output(IWineASIOImpl *This, jack_nframes_t nframes);
+static inline void      period_adapter_input_overrun(IWineASIOImpl *This, unsigned int room, unsigned int frames);
+static inline void      jack_process_finish(IWineASIOImpl *This, jack_nframes_t nframes);
+static inline void      jack_process_account(IWineASIOImpl *This, jack_nframes_t nframes);
+static inline unsigned long long monotonic_ns(void);
+static inline void      timing_host_leave(IWineASIOImpl *This, unsigned long long now);
+static  BOOL            routing_parse_range(const char **spec, long *first, long *last);
+static  BOOL            routing_create(IWineASIOImpl *This, const char *spec, BOOL input, Routing **created);
+static  void            routing_destroy(IWineASIOImpl *This, Routing *routing);
+static  BOOL            shared_statistics_create(IWineASIOImpl *This);
+static  void            shared_statistics_destroy(IWineASIOImpl *This);
+static  void            shared_statistics_publish(IWineASIOImpl *This);
+static inline void      shared_statistics_cycle(IWineASIOImpl *This);
+static  void            trace_create(IWineASIOImpl *This);
+static  void            trace_destroy(IWineASIOImpl *This);
+static inline void      trace_event(IWineASIOImpl *This, const char *name, char phase, const char *arg_name, LONG arg);
+static  void            perf_counters_open(IWineASIOImpl *This, int tid);
+static  void            perf_counters_close(IWineASIOImpl *This);
+static  void            log_configure(const char *spec);
+static  void            log_start(void);
+static  void            log_stop(void);
+static  void            log_print(LONG level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static inline void      log_record(LONG level, const char *format, const LONG *args);
+
 static DWORD WINAPI jack_sync_thread_function(LPVOID arg);
+static DWORD WINAPI asio_async_thread_function(LPVOID arg);
+static inline BOOL      async_thread_disposed(IWineASIOImpl *This);
+static DWORD WINAPI asio_event_thread_function(LPVOID arg);
+static inline BOOL      event_thread_disposed(IWineASIOImpl *This);
+static inline BOOL      event_host_ready(IWineASIOImpl *This);
+static  void            event_thread_join_retired(IWineASIOImpl *This);
+static  void            buffers_release(IWineASIOImpl *This);
+static DWORD WINAPI trace_flush_thread_function(LPVOID arg);
+static DWORD WINAPI log_thread_function(LPVOID arg);
 static DWORD WINAPI jack_thread_creator_helper(LPVOID arg);
 static int          jack_thread_creator(pthread_t* thread_id, const pthread_attr_t* attr, void *(*function)(void*), void* arg);
 
@@ -317,15 +888,19 @@ struct {
 struct {
     HANDLE wine_thread; // wine thread handle
     pthread_t wine_pthread;
-    sigset_t wine_sig_set;
+    sem_t wine_semaphore; // posted by the jack thread for every cycle
     pthread_t jack_pthread;
-    sigset_t jack_sig_set;
+    sem_t jack_semaphore; // posted by the wine thread once the outputs are ready
     void* arg;
     jack_nframes_t nframes;
     char wine_thread_busy;
     char running;
+    char released;
 } jack_sync_privates;
 
+/* shared by all driver instances of the process, warnings and errors of every category by default */
+static Logger logger = { { LogWarn, LogWarn, LogWarn, LogWarn } };
+
 /*****************************************************************************
  * Interface method definitions
  */
@@ -390,28 +965,37 @@ HIDDEN ULONG STDMETHODCALLTYPE Release(LPWINEASIO iface)
         /* just for good measure we deinitialize IOChannel structures and unregister JACK ports */
         for (i = 0; i < This->wineasio_number_inputs; i++)
         {
-            jack_port_unregister (This->jack_client, This->input_channel[i].port);
+            if (This->input_channel[i].port)
+                jack_port_unregister (This->jack_client, This->input_channel[i].port);
             This->input_channel[i].active = ASIOFalse;
             This->input_channel[i].port = NULL;
         }
         for (i = 0; i < This->wineasio_number_outputs; i++)
         {
-            jack_port_unregister (This->jack_client, This->output_channel[i].port);
+            if (This->output_channel[i].port)
+                jack_port_unregister (This->jack_client, This->output_channel[i].port);
             This->output_channel[i].active = ASIOFalse;
             This->output_channel[i].port = NULL;
         }
         This->asio_active_inputs = This->asio_active_outputs = 0;
         TRACE("%i IOChannel structures released\n", This->wineasio_number_inputs + This->wineasio_number_outputs);
+        routing_destroy(This, This->input_routing);
+        routing_destroy(This, This->output_routing);
+        This->input_routing = This->output_routing = NULL;
 
         jack_free (This->jack_output_ports);
         jack_free (This->jack_input_ports);
         jack_client_close(This->jack_client);
+        event_thread_join_retired(This);
+        trace_destroy(This);
+        log_stop();
+        shared_statistics_destroy(This);
         if (This->input_channel)
             HeapFree(GetProcessHeap(), 0, This->input_channel);
     }
     TRACE("WineASIO terminated\n\n");
     if (ref == 0)
-        HeapFree(GetProcessHeap(), 0, This);
+        free(This);
     return ref;
 }
 
@@ -442,19 +1026,20 @@ HIDDEN ASIOBool STDMETHODCALLTYPE Init(LPWINEASIO iface, void *sysRef)
     }
     TRACE("JACK client opened as: '%s'\n", jack_get_client_name(This->jack_client));
 
-    This->asio_sample_rate = jack_get_sample_rate(This->jack_client);
-    This->asio_current_buffersize = jack_get_buffer_size(This->jack_client);
+    This->asio_sample_rate = This->jack_sample_rate = jack_get_sample_rate(This->jack_client);
+    This->asio_current_buffersize = This->jack_buffersize = jack_get_buffer_size(This->jack_client);
 
     /* Allocate IOChannel structures */
-    This->input_channel = HeapAlloc(GetProcessHeap(), 0, (This->wineasio_number_inputs + This->wineasio_number_outputs) * sizeof(IOChannel));
+    This->input_channel = HeapAlloc(GetProcessHeap(), 0, (This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs) * sizeof(IOChannel));
     if (!This->input_channel)
     {
         jack_client_close(This->jack_client);
         ERR("Unable to allocate IOChannel structures for %i channels\n", This->wineasio_number_inputs);
         return ASIOFalse;
     }
-    This->output_channel = This->input_channel + This->wineasio_number_inputs;
-    TRACE("%i IOChannel structures allocated\n", This->wineasio_number_inputs + This->wineasio_number_outputs);
+    /* loopback inputs follow the JACK inputs and have no port */
+    This->output_channel = This->input_channel + This->wineasio_number_inputs + This->wineasio_number_loopbacks;
+    TRACE("%i IOChannel structures allocated\n", This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs);
 
     /* Get and count physical JACK ports */
     This->jack_input_ports = jack_get_ports(This->jack_client, NULL, NULL, JackPortIsPhysical | JackPortIsOutput);
@@ -464,26 +1049,66 @@ HIDDEN ASIOBool STDMETHODCALLTYPE Init(LPWINEASIO iface, void *sysRef)
     for (This->jack_num_output_ports = 0; This->jack_output_ports && This->jack_output_ports[This->jack_num_output_ports]; This->jack_num_output_ports++)
         ;
 
+    /* a routing matrix registers its own ports, the routed channels then get none */
+    This->input_routing = This->output_routing = NULL;
+    if (!routing_create(This, This->wineasio_input_routing, TRUE, &This->input_routing)
+            || !routing_create(This, This->wineasio_output_routing, FALSE, &This->output_routing))
+    {
+        routing_destroy(This, This->input_routing);
+        This->input_routing = NULL;
+        jack_client_close(This->jack_client);
+        HeapFree(GetProcessHeap(), 0, This->input_channel);
+        ERR("Unable to set up the routing matrix\n");
+        return ASIOFalse;
+    }
+
     /* Initialize IOChannel structures */
     for (i = 0; i < This->wineasio_number_inputs; i++)
     {
         This->input_channel[i].active = ASIOFalse;
         This->input_channel[i].port = NULL;
+        This->input_channel[i].gain_target = ASIO_GAIN_UNITY;
+        This->input_channel[i].gain = 1.0f;
+        This->input_channel[i].metered = FALSE;
+        This->input_channel[i].meter_peak = This->input_channel[i].meter_rms = 0;
+        This->input_channel[i].monitor_output = -1;
         snprintf(This->input_channel[i].port_name, ASIO_MAX_NAME_LENGTH, "in_%i", i + 1);
-        This->input_channel[i].port = jack_port_register(This->jack_client,
-            This->input_channel[i].port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, i);
+        if (This->input_routing)
+            This->input_channel[i].port_buffer = This->input_routing->scratch + i * ASIO_MAXIMUM_BUFFERSIZE;
+        else
+            This->input_channel[i].port = jack_port_register(This->jack_client,
+                This->input_channel[i].port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, i);
         /* TRACE("IOChannel structure initialized for input %d: '%s'\n", i, This->input_channel[i].port_name); */
     }
+    for (; i < This->wineasio_number_inputs + This->wineasio_number_loopbacks; i++)
+    {
+        This->input_channel[i].active = ASIOFalse;
+        This->input_channel[i].port = NULL;
+        This->input_channel[i].gain_target = ASIO_GAIN_UNITY;
+        This->input_channel[i].gain = 1.0f;
+        This->input_channel[i].metered = FALSE;
+        This->input_channel[i].meter_peak = This->input_channel[i].meter_rms = 0;
+        This->input_channel[i].monitor_output = -1;
+        snprintf(This->input_channel[i].port_name, ASIO_MAX_NAME_LENGTH, "loopback_%i", (int) (This->wineasio_loopback_source + i - This->wineasio_number_inputs + 1));
+    }
     for (i = 0; i < This->wineasio_number_outputs; i++)
     {
         This->output_channel[i].active = ASIOFalse;
         This->output_channel[i].port = NULL;
+        This->output_channel[i].gain_target = ASIO_GAIN_UNITY;
+        This->output_channel[i].gain = 1.0f;
+        This->output_channel[i].metered = FALSE;
+        This->output_channel[i].meter_peak = This->output_channel[i].meter_rms = 0;
+        This->output_channel[i].monitor_output = -1;
         snprintf(This->output_channel[i].port_name, ASIO_MAX_NAME_LENGTH, "out_%i", i + 1);
-        This->output_channel[i].port = jack_port_register(This->jack_client,
-            This->output_channel[i].port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, i);
+        if (This->output_routing)
+            This->output_channel[i].port_buffer = This->output_routing->scratch + i * ASIO_MAXIMUM_BUFFERSIZE;
+        else
+            This->output_channel[i].port = jack_port_register(This->jack_client,
+                This->output_channel[i].port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, i);
         /* TRACE("IOChannel structure initialized for output %d: '%s'\n", i, This->output_channel[i].port_name); */
     }
-    TRACE("%i IOChannel structures initialized\n", This->wineasio_number_inputs + This->wineasio_number_outputs);
+    TRACE("%i IOChannel structures initialized\n", This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs);
 
     // this function is called on jack_activate to create a thread (not with pipewire-jack)
     jack_set_thread_creator(jack_thread_creator);
@@ -523,7 +1148,30 @@ HIDDEN ASIOBool STDMETHODCALLTYPE Init(LPWINEASIO iface, void *sysRef)
         return ASIOFalse;
     }
 
+    /* only for accounting, the driver works without it */
+    if (jack_set_xrun_callback(This->jack_client, jack_xrun_callback, This))
+    {
+        WARN("Unable to register JACK xrun callback\n");
+    }
+
+    /* only for the time code, the driver is always ready to roll */
+    if (jack_set_sync_callback(This->jack_client, jack_sync_callback, This))
+    {
+        WARN("Unable to register JACK sync callback\n");
+    }
+
+    if (!shared_statistics_create(This))
+    {
+        jack_client_close(This->jack_client);
+        HeapFree(GetProcessHeap(), 0, This->input_channel);
+        ERR("Unable to allocate the driver statistics\n");
+        return ASIOFalse;
+    }
+
     This->asio_driver_state = Initialized;
+    shared_statistics_publish(This);
+    trace_create(This);
+    log_start();
     TRACE("WineASIO 0.%.1f initialized\n",(float) This->asio_version / 10);
     return ASIOTrue;
 }
@@ -578,9 +1226,9 @@ HIDDEN void STDMETHODCALLTYPE GetErrorMessage(LPWINEASIO iface, char *string)
 DEFINE_THISCALL_WRAPPER(Start,4)
 HIDDEN ASIOError STDMETHODCALLTYPE Start(LPWINEASIO iface)
 {
-    IWineASIOImpl   *This = (IWineASIOImpl*)iface;
-    int             i;
-    DWORD           time;
+    IWineASIOImpl       *This = (IWineASIOImpl*)iface;
+    int                 i;
+    unsigned long long  time;
 
     TRACE("iface: %p\n", iface);
 
@@ -588,16 +1236,31 @@ HIDDEN ASIOError STDMETHODCALLTYPE Start(LPWINEASIO iface)
         return ASE_NotPresent;
 
     /* Zero the audio buffer */
-    for (i = 0; i < (This->wineasio_number_inputs + This->wineasio_number_outputs) * 2 * This->asio_current_buffersize; i++)
+    for (i = 0; i < (This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs) * 2 * This->asio_current_buffersize; i++)
         This->callback_audio_buffer[i] = 0;
 
+    /* the adapter may be swapped by the JACK thread at any time, so it primes itself on the first cycle */
+    This->adapter_reset_pending = TRUE;
+    This->cycle_frame_time_valid = FALSE;
+    This->clock_valid = FALSE;
+
+    /* the first cycle queries the transport, the priming buffer gets it as it is now */
+    This->transport_resync = TRUE;
+    This->transport_rolling = FALSE;
+    This->transport_frame = jack_get_current_transport_frame(This->jack_client);
+
+    /* OutputReady() during the priming buffer has no JACK cycle to finish */
+    This->output_ready_armed = This->output_ready_done = FALSE;
+
     /* prime the callback by preprocessing one outbound ASIO bufffer */
     This->asio_buffer_index =  0;
     This->asio_sample_position.hi = This->asio_sample_position.lo = 0;
+    This->asio_sample_jump = 0;
 
-    time = timeGetTime();
-    This->asio_time_stamp.lo = time * 1000000;
-    This->asio_time_stamp.hi = ((unsigned long long) time * 1000000) >> 32;
+    time = monotonic_ns();
+    This->asio_time_stamp.lo = time;
+    This->asio_time_stamp.hi = time >> 32;
+    snapshot_publish(&This->position, 0, time);
 
     if (This->asio_time_info_mode) /* use the newer bufferSwitchTimeInfo method if supported */
     {
@@ -608,12 +1271,7 @@ HIDDEN ASIOError STDMETHODCALLTYPE Start(LPWINEASIO iface)
         This->asio_time.timeInfo.flags = kSystemTimeValid | kSamplePositionValid | kSampleRateValid;
 
         if (This->asio_can_time_code) /* addionally use time code if supported */
-        {
-            This->asio_time.timeCode.speed = 1; /* FIXME */
-            This->asio_time.timeCode.timeCodeSamples.lo = This->asio_time_stamp.lo;
-            This->asio_time.timeCode.timeCodeSamples.hi = This->asio_time_stamp.hi;
-            This->asio_time.timeCode.flags = ~(kTcValid | kTcRunning);
-        }
+            transport_time_code(This, 0);
         This->asio_callbacks->bufferSwitchTimeInfo(&This->asio_time, This->asio_buffer_index, ASIOTrue);
     } 
     else
@@ -624,7 +1282,9 @@ HIDDEN ASIOError STDMETHODCALLTYPE Start(LPWINEASIO iface)
     /* swith asio buffer */
     This->asio_buffer_index = This->asio_buffer_index ? 0 : 1;
 
-    This->asio_driver_state = Running;
+    __atomic_store_n(&This->asio_driver_state, Running, __ATOMIC_SEQ_CST);
+    shared_statistics_publish(This);
+    trace_event(This, "Start", 'i', NULL, 0);
     TRACE("WineASIO successfully loaded\n");
     return ASE_OK;
 }
@@ -646,7 +1306,13 @@ HIDDEN ASIOError STDMETHODCALLTYPE Stop(LPWINEASIO iface)
     if (This->asio_driver_state != Running)
         return ASE_NotPresent;
 
-    This->asio_driver_state = Prepared;
+    __atomic_store_n(&This->asio_driver_state, Prepared, __ATOMIC_SEQ_CST);
+    shared_statistics_publish(This);
+    trace_event(This, "Stop", 'i', NULL, 0);
+
+    /* let the asynchronous thread finish the buffer it is working on, unless the host stops from within it */
+    while (GetCurrentThreadId() != This->async_thread_id && __atomic_load_n(&This->async_busy, __ATOMIC_SEQ_CST))
+        Sleep(1);
 
     return ASE_OK;
 }
@@ -666,9 +1332,9 @@ HIDDEN ASIOError STDMETHODCALLTYPE GetChannels (LPWINEASIO iface, LONG *numInput
     if (!numInputChannels || !numOutputChannels)
         return ASE_InvalidParameter;
 
-    *numInputChannels = This->wineasio_number_inputs;
+    *numInputChannels = This->wineasio_number_inputs + This->wineasio_number_loopbacks;
     *numOutputChannels = This->wineasio_number_outputs;
-    TRACE("iface: %p, inputs: %i, outputs: %i\n", iface, This->wineasio_number_inputs, This->wineasio_number_outputs);
+    TRACE("iface: %p, inputs: %i, outputs: %i\n", iface, *numInputChannels, This->wineasio_number_outputs);
     return ASE_OK;
 }
 
@@ -683,6 +1349,8 @@ HIDDEN ASIOError STDMETHODCALLTYPE GetLatencies(LPWINEASIO iface, LONG *inputLat
 {
     IWineASIOImpl           *This = (IWineASIOImpl*)iface;
     jack_latency_range_t    range;
+    jack_nframes_t          input = 0, output = 0;
+    int                     i;
 
     if (!inputLatency || !outputLatency)
         return ASE_InvalidParameter;
@@ -690,10 +1358,24 @@ HIDDEN ASIOError STDMETHODCALLTYPE GetLatencies(LPWINEASIO iface, LONG *inputLat
     if (This->asio_driver_state == Loaded)
         return ASE_NotPresent;
 
-    jack_port_get_latency_range(This->input_channel[0].port, JackCaptureLatency, &range);
-    *inputLatency = range.max;
-    jack_port_get_latency_range(This->output_channel[0].port, JackPlaybackLatency, &range);
-    *outputLatency = range.max;
+    /* JACK latencies are in JACK frames, the host counts at its own sample rate, and any port may be connected.
+     * The adapter's share is the one published to the graph, so an adapter swap in progress never blocks the host here. */
+    for (i = 0; i < jack_port_count(This, TRUE); i++)
+    {
+        jack_port_get_latency_range(jack_port_at(This, TRUE, i), JackCaptureLatency, &range);
+        if (range.max > input)
+            input = range.max;
+    }
+    for (i = 0; i < jack_port_count(This, FALSE); i++)
+    {
+        jack_port_get_latency_range(jack_port_at(This, FALSE, i), JackPlaybackLatency, &range);
+        if (range.max > output)
+            output = range.max;
+    }
+    input += __atomic_load_n(&This->adapter_input_latency, __ATOMIC_SEQ_CST);
+    output += __atomic_load_n(&This->adapter_output_latency, __ATOMIC_SEQ_CST);
+    *inputLatency = input * This->asio_sample_rate / This->jack_sample_rate;
+    *outputLatency = output * This->asio_sample_rate / This->jack_sample_rate;
     TRACE("iface: %p, input latency: %d, output latency: %d\n", iface, *inputLatency, *outputLatency);
 
     return ASE_OK;
@@ -718,16 +1400,17 @@ HIDDEN ASIOError STDMETHODCALLTYPE GetBufferSize(LPWINEASIO iface, LONG *minSize
 
     if (This->wineasio_fixed_buffersize)
     {
-        *minSize = *maxSize = *preferredSize = This->asio_current_buffersize;
+        *minSize = *maxSize = *preferredSize = This->jack_buffersize;
         *granularity = 0;
-        TRACE("Buffersize fixed at %i\n", This->asio_current_buffersize);
+        TRACE("Buffersize fixed at %i\n", This->jack_buffersize);
         return ASE_OK;
     }
 
     *minSize = ASIO_MINIMUM_BUFFERSIZE;
     *maxSize = ASIO_MAXIMUM_BUFFERSIZE;
     *preferredSize = This->wineasio_preferred_buffersize;
-    *granularity = -1;
+    /* decoupled from JACK any size works, otherwise only powers of two */
+    *granularity = This->wineasio_decoupled_buffersize ? 1 : -1;
     TRACE("The ASIO host can control buffersize\nMinimum: %i, maximum: %i, preferred: %i, granularity: %i, current: %i\n",
           *minSize, *maxSize, *preferredSize, *granularity, This->asio_current_buffersize);
     return ASE_OK;
@@ -746,9 +1429,15 @@ HIDDEN ASIOError STDMETHODCALLTYPE CanSampleRate(LPWINEASIO iface, ASIOSampleRat
 
     TRACE("iface: %p, Samplerate = %li, requested samplerate = %li\n", iface, (long) This->asio_sample_rate, (long) sampleRate);
 
-    if (sampleRate != This->asio_sample_rate)
-        return ASE_NoClock;
-    return ASE_OK;
+    if (sampleRate == This->jack_sample_rate)
+        return ASE_OK;
+
+    /* anything else is converted, within the range the resampler kernel is designed for */
+    if (This->wineasio_resampling
+            && sampleRate * RESAMPLER_MAXIMUM_RATIO >= This->jack_sample_rate
+            && sampleRate <= This->jack_sample_rate * RESAMPLER_MAXIMUM_RATIO)
+        return ASE_OK;
+    return ASE_NoClock;
 }
 
 /*
@@ -784,11 +1473,37 @@ DEFINE_THISCALL_WRAPPER(SetSampleRate,12)
 HIDDEN ASIOError STDMETHODCALLTYPE SetSampleRate(LPWINEASIO iface, ASIOSampleRate sampleRate)
 {
     IWineASIOImpl   *This = (IWineASIOImpl*)iface;
+    ASIOSampleRate  previous = This->asio_sample_rate;
+    BOOL            replaced;
 
     TRACE("iface: %p, Sample rate %f requested\n", iface, sampleRate);
 
-    if (sampleRate != This->asio_sample_rate)
+    if (sampleRate == This->asio_sample_rate)
+        return ASE_OK;
+    if (CanSampleRate(iface, sampleRate) != ASE_OK)
         return ASE_NoClock;
+
+    This->asio_sample_rate = sampleRate;
+    TRACE("ASIO sample rate set to %i, JACK runs at %i\n", (int) This->asio_sample_rate, This->jack_sample_rate);
+
+    /* A running host may call this from its own callbacks, which the swap would wait for,
+     * the event thread takes over the conversion at the new rate like for a new JACK rate */
+    if (This->asio_driver_state == Running)
+    {
+        post_event(This, EventHostSampleRate);
+    }
+    /* buffers exist already, convert at the new rate from the next JACK cycle on */
+    else if (This->asio_driver_state == Prepared)
+    {
+        pthread_mutex_lock(&This->adapter_lock);
+        replaced = period_adapter_replace(This, This->period_adapter->jack_buffersize);
+        pthread_mutex_unlock(&This->adapter_lock);
+        if (!replaced)
+        {
+            This->asio_sample_rate = previous;
+            return ASE_NoMemory;
+        }
+    }
     return ASE_OK;
 }
 
@@ -849,17 +1564,32 @@ HIDDEN ASIOError STDMETHODCALLTYPE SetClockSource(LPWINEASIO iface, LONG index)
 DEFINE_THISCALL_WRAPPER(GetSamplePosition,12)
 HIDDEN ASIOError STDMETHODCALLTYPE GetSamplePosition(LPWINEASIO iface, ASIOSamples *sPos, ASIOTimeStamp *tStamp)
 {
-    IWineASIOImpl   *This = (IWineASIOImpl*)iface;
+    IWineASIOImpl       *This = (IWineASIOImpl*)iface;
+    unsigned long long  position, system_time, now, frames;
+    double              rate;
 
     TRACE("iface: %p, sPos: %p, tStamp: %p\n", iface, sPos, tStamp);
 
     if (!sPos || !tStamp)
         return ASE_InvalidParameter;
 
-    tStamp->lo = This->asio_time_stamp.lo;
-    tStamp->hi = This->asio_time_stamp.hi;
-    sPos->lo = This->asio_sample_position.lo;
-    sPos->hi = 0; /* FIXME */
+    snapshot_read(&This->position, &position, &system_time);
+
+    /* run on from the last buffer at the measured rate, at most to where the next one starts */
+    if (This->wineasio_interpolate_position && This->asio_driver_state == Running && (now = monotonic_ns()) > system_time)
+    {
+        rate = This->asio_sample_rate * (1.0 + __atomic_load_n(&This->statistics->clock_drift, __ATOMIC_RELAXED) / 1e9);
+        frames = (now - system_time) * rate / 1e9;
+        if (frames > This->asio_current_buffersize)
+            frames = This->asio_current_buffersize;
+        position += frames;
+        system_time += (unsigned long long) (frames * 1e9 / rate);
+    }
+
+    tStamp->lo = system_time;
+    tStamp->hi = system_time >> 32;
+    sPos->lo = position;
+    sPos->hi = position >> 32;
 
     return ASE_OK;
 }
@@ -877,7 +1607,8 @@ HIDDEN ASIOError STDMETHODCALLTYPE GetChannelInfo(LPWINEASIO iface, ASIOChannelI
 
     /* TRACE("(iface: %p, info: %p\n", iface, info); */
 
-    if (info->channel < 0 || (info->isInput ? info->channel >= This->wineasio_number_inputs : info->channel >= This->wineasio_number_outputs))
+    if (info->channel < 0 || (info->isInput ? info->channel >= This->wineasio_number_inputs + This->wineasio_number_loopbacks
+                                            : info->channel >= This->wineasio_number_outputs))
         return ASE_InvalidParameter;
 
     info->channelGroup = 0;
@@ -914,7 +1645,7 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
 {
     IWineASIOImpl   *This = (IWineASIOImpl*)iface;
     ASIOBufferInfo  *buffer_info = bufferInfo;
-    int             i, j, k;
+    int             i, j, k, ports;
 
     TRACE("iface: %p, bufferInfo: %p, numChannels: %i, bufferSize: %i, asioCallbacks: %p\n", iface, bufferInfo, numChannels, bufferSize, asioCallbacks);
 
@@ -929,7 +1660,7 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
     {
         if (buffer_info->isInput)
         {
-            if (j++ >= This->wineasio_number_inputs)
+            if (j++ >= This->wineasio_number_inputs + This->wineasio_number_loopbacks)
             {
                 WARN("Invalid input channel requested\n");
                 return ASE_InvalidMode;
@@ -948,10 +1679,21 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
     /* set buf_size */
     if (This->wineasio_fixed_buffersize)
     {
-        if (This->asio_current_buffersize != bufferSize)
+        if (This->jack_buffersize != bufferSize)
             return ASE_InvalidMode;
+        This->asio_current_buffersize = bufferSize;
         TRACE("Buffersize fixed at %i\n", This->asio_current_buffersize);
     }
+    else if (This->wineasio_decoupled_buffersize)
+    { /* leave the JACK period alone, the period adapter bridges any size in range */
+        if (bufferSize < ASIO_MINIMUM_BUFFERSIZE || bufferSize > ASIO_MAXIMUM_BUFFERSIZE)
+        {
+            WARN("Invalid buffersize %i requested\n", bufferSize);
+            return ASE_InvalidMode;
+        }
+        This->asio_current_buffersize = bufferSize;
+        TRACE("Buffer size set to %i, JACK period stays at %i\n", This->asio_current_buffersize, This->jack_buffersize);
+    }
     else
     { /* fail if not a power of two and if out of range */
         if (!(bufferSize > 0 && !(bufferSize&(bufferSize-1))
@@ -975,24 +1717,45 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
                     WARN("JACK is unable to set buffersize to %i\n", This->asio_current_buffersize);
                     return ASE_HWMalfunction;
                 }
+                This->jack_buffersize = This->asio_current_buffersize;
                 TRACE("Buffer size changed to %i\n", This->asio_current_buffersize);
             }
         }
     }
 
     /* print/discover ASIO host capabilities */
+    /* they are probed only once, the answers are used by the event thread later on */
     This->asio_callbacks = asioCallbacks;
     This->asio_time_info_mode = This->asio_can_time_code = FALSE;
+    This->asio_can_buffer_size_change = This->asio_can_reset_request = FALSE;
+    This->asio_can_resync_request = This->asio_can_latencies_changed = This->asio_can_overload = FALSE;
 
     TRACE("The ASIO host supports ASIO v%i: ", This->asio_callbacks->asioMessage(kAsioEngineVersion, 0, 0, 0));
     if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioBufferSizeChange, 0 , 0))
+    {
         TRACE("kAsioBufferSizeChange ");
+        This->asio_can_buffer_size_change = TRUE;
+    }
     if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioResetRequest, 0 , 0))
+    {
         TRACE("kAsioResetRequest ");
+        This->asio_can_reset_request = TRUE;
+    }
     if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioResyncRequest, 0 , 0))
+    {
         TRACE("kAsioResyncRequest ");
+        This->asio_can_resync_request = TRUE;
+    }
     if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioLatenciesChanged, 0 , 0))
+    {
         TRACE("kAsioLatenciesChanged ");
+        This->asio_can_latencies_changed = TRUE;
+    }
+    if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioOverload, 0 , 0))
+    {
+        TRACE("kAsioOverload ");
+        This->asio_can_overload = TRUE;
+    }
 
     if (This->asio_callbacks->asioMessage(kAsioSupportsTimeInfo, 0, 0, 0))
     {
@@ -1010,26 +1773,54 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
 
     /* Allocate audio buffers */
 
-    This->callback_audio_buffer = HeapAlloc(GetProcessHeap(), 0,
-        (This->wineasio_number_inputs + This->wineasio_number_outputs) * 2 * This->asio_current_buffersize * sizeof(jack_default_audio_sample_t));
+    i = This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs;
+    This->callback_audio_buffer = HeapAlloc(GetProcessHeap(), 0, i * 2 * This->asio_current_buffersize * sizeof(jack_default_audio_sample_t));
     if (!This->callback_audio_buffer)
     {
-        ERR("Unable to allocate %i ASIO audio buffers\n", This->wineasio_number_inputs + This->wineasio_number_outputs);
+        ERR("Unable to allocate %i ASIO audio buffers\n", i);
         return ASE_NoMemory;
     }
-    TRACE("%i ASIO audio buffers allocated (%i kB)\n", This->wineasio_number_inputs + This->wineasio_number_outputs,
-          (int) ((This->wineasio_number_inputs + This->wineasio_number_outputs) * 2 * This->asio_current_buffersize * sizeof(jack_default_audio_sample_t) / 1024));
+    TRACE("%i ASIO audio buffers allocated (%i kB)\n", i, (int) (i * 2 * This->asio_current_buffersize * sizeof(jack_default_audio_sample_t) / 1024));
 
-    for (i = 0; i < This->wineasio_number_inputs; i++)
+    This->period_adapter = period_adapter_create(This, This->jack_buffersize, This->asio_current_buffersize);
+    if (!This->period_adapter)
+    {
+        HeapFree(GetProcessHeap(), 0, This->callback_audio_buffer);
+        This->callback_audio_buffer = NULL;
+        ERR("Unable to allocate the period adapter for %i/%i frames\n", This->jack_buffersize, This->asio_current_buffersize);
+        return ASE_NoMemory;
+    }
+    pthread_mutex_init(&This->adapter_lock, NULL);
+    This->pending_adapter = This->retired_adapter = NULL;
+    period_adapter_publish_latency(This, This->period_adapter);
+    This->output_ready_armed = This->output_ready_done = FALSE;
+
+    /* the semaphore is only set up again once no old thread can wait on it */
+    event_thread_join_retired(This);
+    sem_init(&This->event_semaphore, 0, 0);
+    This->event_running = TRUE;
+    This->event_pending = 0;
+    This->event_thread = CreateThread(NULL, 0, asio_event_thread_function, This, 0, &This->event_thread_id);
+
+    /* any later adapter may need it, waiting for a JACK period it stays idle otherwise */
+    sem_init(&This->async_semaphore, 0, 0);
+    This->async_running = TRUE;
+    This->async_busy = FALSE;
+    This->async_thread = CreateThread(NULL, 0, asio_async_thread_function, This, 0, &This->async_thread_id);
+    if (This->wineasio_async_periods > 0)
+        TRACE("Asynchronous mode, the host runs %i periods behind JACK\n", This->wineasio_async_periods);
+
+    for (i = 0; i < This->wineasio_number_inputs + This->wineasio_number_loopbacks; i++)
         This->input_channel[i].audio_buffer = This->callback_audio_buffer + (i * 2 * This->asio_current_buffersize);
     for (i = 0; i < This->wineasio_number_outputs; i++)
-        This->output_channel[i].audio_buffer = This->callback_audio_buffer + ((This->wineasio_number_inputs + i) * 2 * This->asio_current_buffersize);
+        This->output_channel[i].audio_buffer = This->callback_audio_buffer
+            + ((This->wineasio_number_inputs + This->wineasio_number_loopbacks + i) * 2 * This->asio_current_buffersize);
 
     /* initialize ASIOBufferInfo structures */
     buffer_info = bufferInfo;
     This->asio_active_inputs = This->asio_active_outputs = 0;
 
-    for (i = 0; i < This->wineasio_number_inputs; i++) {
+    for (i = 0; i < This->wineasio_number_inputs + This->wineasio_number_loopbacks; i++) {
         This->input_channel[i].active = ASIOFalse;
     }
     for (i = 0; i < This->wineasio_number_outputs; i++) {
@@ -1058,7 +1849,11 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
     TRACE("%i audio channels initialized\n", This->asio_active_inputs + This->asio_active_outputs);
 
     if (jack_activate(This->jack_client))
+    {
+        ERR("Unable to activate the JACK client\n");
+        buffers_release(This);
         return ASE_NotPresent;
+    }
 
     if (jack_thread_creator_privates.jack_callback_thread == NULL)
     {
@@ -1070,16 +1865,10 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
         jack_sync_privates.wine_pthread = 0;
         jack_sync_privates.jack_pthread = 0;
 
-        // Maybe this is faster than condition variables?
-        // https://stackoverflow.com/a/23945651
-        // TODO needs a/b testing to be sure
-        sigemptyset(&jack_sync_privates.wine_sig_set);
-        sigaddset(&jack_sync_privates.wine_sig_set, SIGUSR1);
-        sigaddset(&jack_sync_privates.wine_sig_set, SIGSEGV);
-
-        sigemptyset(&jack_sync_privates.jack_sig_set);
-        sigaddset(&jack_sync_privates.jack_sig_set, SIGUSR1);
-        sigaddset(&jack_sync_privates.jack_sig_set, SIGSEGV);
+        // Counting semaphores keep a wakeup that arrives while the other thread is still busy,
+        // with OutputReady() the jack thread carries on while the wine thread is in host code
+        sem_init(&jack_sync_privates.wine_semaphore, 0, 0);
+        sem_init(&jack_sync_privates.jack_semaphore, 0, 0);
 
         jack_sync_privates.running = 1;
         jack_sync_privates.wine_thread = CreateThread(
@@ -1089,16 +1878,32 @@ HIDDEN ASIOError STDMETHODCALLTYPE CreateBuffers(LPWINEASIO iface, ASIOBufferInf
     /* connect to the hardware io */
     if (This->wineasio_connect_to_hardware)
     {
-        for (i = 0; i < This->jack_num_input_ports && i < This->wineasio_number_inputs; i++)
-            if (strstr(jack_port_type(jack_port_by_name(This->jack_client, This->jack_input_ports[i])), "audio"))
-                jack_connect(This->jack_client, This->jack_input_ports[i], jack_port_name(This->input_channel[i].port));
-        for (i = 0; i < This->jack_num_output_ports && i < This->wineasio_number_outputs; i++)
-            if (strstr(jack_port_type(jack_port_by_name(This->jack_client, This->jack_output_ports[i])), "audio"))
-                jack_connect(This->jack_client, jack_port_name(This->output_channel[i].port), This->jack_output_ports[i]);
+        /* routed ports go to the hardware port of their own number */
+        ports = This->input_routing ? This->input_routing->num_ports : This->wineasio_number_inputs;
+        for (i = 0; i < ports; i++)
+        {
+            k = This->input_routing ? This->input_routing->port_numbers[i] - 1 : i;
+            if (k < This->jack_num_input_ports
+                    && strstr(jack_port_type(jack_port_by_name(This->jack_client, This->jack_input_ports[k])), "audio"))
+                jack_connect(This->jack_client, This->jack_input_ports[k],
+                             jack_port_name(This->input_routing ? This->input_routing->ports[i] : This->input_channel[i].port));
+        }
+        ports = This->output_routing ? This->output_routing->num_ports : This->wineasio_number_outputs;
+        for (i = 0; i < ports; i++)
+        {
+            k = This->output_routing ? This->output_routing->port_numbers[i] - 1 : i;
+            if (k < This->jack_num_output_ports
+                    && strstr(jack_port_type(jack_port_by_name(This->jack_client, This->jack_output_ports[k])), "audio"))
+                jack_connect(This->jack_client,
+                             jack_port_name(This->output_routing ? This->output_routing->ports[i] : This->output_channel[i].port),
+                             This->jack_output_ports[k]);
+        }
     }
 
     /* at this point all the connections are made and the jack process callback is outputting silence */
     This->asio_driver_state = Prepared;
+    shared_statistics_publish(This);
+    trace_event(This, "CreateBuffers", 'i', "buffer_size", This->asio_current_buffersize);
     return ASE_OK;
 }
 
@@ -1114,15 +1919,18 @@ DEFINE_THISCALL_WRAPPER(DisposeBuffers,4)
 HIDDEN ASIOError STDMETHODCALLTYPE DisposeBuffers(LPWINEASIO iface)
 {
     IWineASIOImpl   *This = (IWineASIOImpl*)iface;
-    int             i;
 
     if (jack_sync_privates.wine_thread != NULL) {
         jack_sync_privates.running = 0;
         // Might be too dangerous
         // TerminateThread(jack_sync_privates.wine_thread, 0);
-        // Wait wine thread to exit
+        // Wake the wine thread and wait for it to exit
+        sem_post(&jack_sync_privates.wine_semaphore);
         WaitForSingleObject(jack_sync_privates.wine_thread, INFINITE);
+        CloseHandle(jack_sync_privates.wine_thread);
         jack_sync_privates.wine_thread = NULL;
+        sem_destroy(&jack_sync_privates.wine_semaphore);
+        sem_destroy(&jack_sync_privates.jack_semaphore);
     }
 
     TRACE("iface: %p\n", iface);
@@ -1135,9 +1943,60 @@ HIDDEN ASIOError STDMETHODCALLTYPE DisposeBuffers(LPWINEASIO iface)
     if (jack_deactivate(This->jack_client))
         return ASE_NotPresent;
 
+    buffers_release(This);
+
+    This->asio_driver_state = Initialized;
+    shared_statistics_publish(This);
+    trace_event(This, "DisposeBuffers", 'i', NULL, 0);
+    return ASE_OK;
+}
+
+/*
+ *  Stop the threads and free everything CreateBuffers() set up, once JACK no longer calls the process callback
+ */
+static void buffers_release(IWineASIOImpl *This)
+{
+    int             i;
+
+    if (This->async_thread)
+    {
+        This->async_running = FALSE;
+        sem_post(&This->async_semaphore);
+        if (GetCurrentThreadId() != This->async_thread_id)
+            WaitForSingleObject(This->async_thread, INFINITE);
+        CloseHandle(This->async_thread);
+        This->async_thread = NULL;
+        This->async_thread_id = 0;
+        sem_destroy(&This->async_semaphore);
+    }
+
+    /* A host may dispose its buffers right from a message delivered on the event thread,
+     * which then leaves its loop as soon as the host returns without waiting again */
+    if (This->event_thread)
+    {
+        This->event_running = FALSE;
+        sem_post(&This->event_semaphore);
+        if (GetCurrentThreadId() != This->event_thread_id)
+        {
+            WaitForSingleObject(This->event_thread, INFINITE);
+            CloseHandle(This->event_thread);
+        }
+        else
+        {
+            event_thread_join_retired(This);
+            This->event_thread_retired = This->event_thread;
+            This->event_thread_retired_id = This->event_thread_id;
+        }
+        sem_destroy(&This->event_semaphore);
+        This->event_thread = NULL;
+        This->event_thread_id = 0;
+    }
+    perf_counters_close(This);
+    This->perf_request_tid = 0;
+
     This->asio_callbacks = NULL;
 
-    for (i = 0; i < This->wineasio_number_inputs; i++)
+    for (i = 0; i < This->wineasio_number_inputs + This->wineasio_number_loopbacks; i++)
     {
         This->input_channel[i].audio_buffer = NULL;
         This->input_channel[i].active = ASIOFalse;
@@ -1151,9 +2010,14 @@ HIDDEN ASIOError STDMETHODCALLTYPE DisposeBuffers(LPWINEASIO iface)
 
     if (This->callback_audio_buffer)
         HeapFree(GetProcessHeap(), 0, This->callback_audio_buffer);
+    This->callback_audio_buffer = NULL;
 
-    This->asio_driver_state = Initialized;
-    return ASE_OK;
+    period_adapter_destroy(This->period_adapter);
+    period_adapter_destroy(This->pending_adapter);
+    period_adapter_destroy(This->retired_adapter);
+    This->period_adapter = This->pending_adapter = This->retired_adapter = NULL;
+    pthread_mutex_destroy(&This->adapter_lock);
+    This->adapter_input_latency = This->adapter_output_latency = 0;
 }
 
 /*
@@ -1191,12 +2055,16 @@ DEFINE_THISCALL_WRAPPER(Future,12)
 HIDDEN ASIOError STDMETHODCALLTYPE Future(LPWINEASIO iface, LONG selector, void *opt)
 {
     IWineASIOImpl           *This = (IWineASIOImpl *) iface;
+    IOChannel               *channel;
+    ASIOInputMonitor        *monitor;
+    int                     i;
 
     TRACE("iface: %p, selector: %i, opt: %p\n", iface, selector, opt);
 
     switch (selector)
     {
         case kAsioEnableTimeCodeRead:
+            This->transport_resync = TRUE;
             This->asio_can_time_code = TRUE;
             TRACE("The ASIO host enabled TimeCode\n");
             return ASE_SUCCESS;
@@ -1205,26 +2073,41 @@ HIDDEN ASIOError STDMETHODCALLTYPE Future(LPWINEASIO iface, LONG selector, void
             TRACE("The ASIO host disabled TimeCode\n");
             return ASE_SUCCESS;
         case kAsioSetInputMonitor:
-            TRACE("The driver denied request to set input monitor\n");
-            return ASE_NotPresent;
+            monitor = opt;
+            if (!monitor || !This->input_channel || monitor->input < -1 || monitor->input >= This->wineasio_number_inputs
+                    || monitor->output < 0 || monitor->output >= This->wineasio_number_outputs)
+                return ASE_InvalidParameter;
+            TRACE("Input monitor %s for input %i to output %i, gain %x, pan %x\n", monitor->state ? "on" : "off",
+                  monitor->input, monitor->output, monitor->gain, monitor->pan);
+            /* an input of -1 addresses all of them */
+            for (i = monitor->input < 0 ? 0 : monitor->input; i < This->wineasio_number_inputs && (monitor->input < 0 || i == monitor->input); i++)
+            {
+                __atomic_store_n(&This->input_channel[i].monitor_gain, monitor->gain < 0 ? 0 : monitor->gain, __ATOMIC_RELAXED);
+                __atomic_store_n(&This->input_channel[i].monitor_pan, monitor->pan < 0 ? 0 : monitor->pan, __ATOMIC_RELAXED);
+                __atomic_store_n(&This->input_channel[i].monitor_output, monitor->state ? monitor->output : -1, __ATOMIC_RELEASE);
+            }
+            return ASE_SUCCESS;
         case kAsioTransport:
             TRACE("The driver denied request for ASIO Transport control\n");
             return ASE_InvalidParameter;
         case kAsioSetInputGain:
-            TRACE("The driver denied request to set input gain\n");
-            return ASE_InvalidParameter;
-        case kAsioGetInputMeter:
-            TRACE("The driver denied request to get input meter \n");
-            return ASE_InvalidParameter;
         case kAsioSetOutputGain:
-            TRACE("The driver denied request to set output gain\n");
-            return ASE_InvalidParameter;
+            if (!(channel = channel_from_controls(This, opt, selector == kAsioSetInputGain)))
+                return ASE_InvalidParameter;
+            /* picked up by the JACK thread at its next copy, which ramps to it over one buffer */
+            __atomic_store_n(&channel->gain_target, ((ASIOChannelControls *) opt)->gain < 0 ? 0 : ((ASIOChannelControls *) opt)->gain, __ATOMIC_RELAXED);
+            return ASE_SUCCESS;
+        case kAsioGetInputMeter:
         case kAsioGetOutputMeter:
-            TRACE("The driver denied request to get output meter\n");
-            return ASE_InvalidParameter;
+            if (!(channel = channel_from_controls(This, opt, selector == kAsioGetInputMeter)))
+                return ASE_InvalidParameter;
+            /* metering starts with the first request, the peak is held until it is read */
+            __atomic_store_n(&channel->metered, TRUE, __ATOMIC_RELAXED);
+            ((ASIOChannelControls *) opt)->meter = __atomic_exchange_n(&channel->meter_peak, 0, __ATOMIC_RELAXED);
+            return ASE_SUCCESS;
         case kAsioCanInputMonitor:
-            TRACE("The driver does not support input monitor\n");
-            return ASE_InvalidParameter;
+            TRACE("The driver supports input monitor\n");
+            return ASE_SUCCESS;
         case kAsioCanTimeInfo:
             TRACE("The driver supports TimeInfo\n");
             return ASE_SUCCESS;
@@ -1235,17 +2118,17 @@ HIDDEN ASIOError STDMETHODCALLTYPE Future(LPWINEASIO iface, LONG selector, void
             TRACE("The driver denied request for ASIO Transport\n");
             return ASE_InvalidParameter;
         case kAsioCanInputGain:
-            TRACE("The driver does not support input gain\n");
-            return ASE_InvalidParameter;
+            TRACE("The driver supports input gain\n");
+            return ASE_SUCCESS;
         case kAsioCanInputMeter:
-            TRACE("The driver does not support input meter\n");
-            return ASE_InvalidParameter;
+            TRACE("The driver supports input meter\n");
+            return ASE_SUCCESS;
         case kAsioCanOutputGain:
-            TRACE("The driver does not support output gain\n");
-            return ASE_InvalidParameter;
+            TRACE("The driver supports output gain\n");
+            return ASE_SUCCESS;
         case kAsioCanOutputMeter:
-            TRACE("The driver does not support output meter\n");
-            return ASE_InvalidParameter;
+            TRACE("The driver supports output meter\n");
+            return ASE_SUCCESS;
         case kAsioSetIoFormat:
             TRACE("The driver denied request to set DSD IO format\n");
             return ASE_NotPresent;
@@ -1266,236 +2149,2648 @@ HIDDEN ASIOError STDMETHODCALLTYPE Future(LPWINEASIO iface, LONG selector, void
  *  Function:   Tells the driver that output bufffers are ready
  *  Returns:    ASE_OK if supported
  *              ASE_NotPresent to disable
+ *  Implementation: On the last ASIO buffer of a JACK cycle the outputs are handed to JACK right away
+ *              and the JACK thread is let go, so the host's remaining work is off the critical path.
+ *              Otherwise the outputs are copied once bufferSwitch returns, as without OutputReady.
  */
 
 DEFINE_THISCALL_WRAPPER(OutputReady,4)
 HIDDEN ASIOError STDMETHODCALLTYPE OutputReady(LPWINEASIO iface)
 {
+    IWineASIOImpl   *This = (IWineASIOImpl*)iface;
+
     /* disabled to stop stand alone NI programs from spamming the console
     TRACE("iface: %p\n", iface); */
-    return ASE_NotPresent;
+    if (!This->output_ready_armed || This->output_ready_done)
+        return ASE_OK;
+
+    timing_host_leave(This, monotonic_ns());
+    trace_event(This, "OutputReady", 'i', NULL, 0);
+
+    if (This->period_adapter->mode == AdapterSlice)
+    {
+        period_adapter_slice_output(This, This->output_ready_nframes - This->asio_current_buffersize);
+    }
+    else
+    {
+        /* only armed without the asynchronous thread, the JACK thread swaps adapters between its own cycles */
+        period_adapter_ring_write(This, This->period_adapter);
+        period_adapter_ring_output(This, This->output_ready_nframes);
+    }
+    This->output_ready_done = TRUE;
+    jack_process_finish(This, This->output_ready_nframes);
+    return ASE_OK;
 }
 
 /****************************************************************************
  *  JACK callbacks
  */
 
+/*
+ *  This may run on the JACK process thread, so the new adapter is built and the host
+ *  is told on the event thread while the current one carries on
+ */
 static inline int jack_buffer_size_callback(jack_nframes_t nframes, void *arg)
 {
     IWineASIOImpl   *This = (IWineASIOImpl*)arg;
 
-    if(This->asio_driver_state != Running)
-        return 0;
+    __atomic_store_n(&This->jack_buffersize, nframes, __ATOMIC_SEQ_CST);
+    PROBE(buffer_size, nframes);
+    LOG_RT(LogEvents, LogInfo, "JACK period is now %i frames\n", nframes);
 
-    if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioResetRequest, 0 , 0))
-        This->asio_callbacks->asioMessage(kAsioResetRequest, 0, 0, 0);
+    if (This->event_thread)
+        post_event(This, EventJackBufferSize);
     return 0;
 }
 
-static inline void jack_latency_callback(jack_latency_callback_mode_t mode, void *arg)
+/* the JACK ports of one direction, those of the routing matrix if there is one */
+static inline int jack_port_count(IWineASIOImpl *This, BOOL input)
 {
-    IWineASIOImpl   *This = (IWineASIOImpl*)arg;
+    Routing         *routing = input ? This->input_routing : This->output_routing;
 
-    if(This->asio_driver_state != Running)
-        return;
+    if (routing)
+        return routing->num_ports;
+    return input ? This->wineasio_number_inputs : This->wineasio_number_outputs;
+}
 
-    if (This->asio_callbacks->asioMessage(kAsioSelectorSupported, kAsioLatenciesChanged, 0 , 0))
-        This->asio_callbacks->asioMessage(kAsioLatenciesChanged, 0, 0, 0);
+static inline jack_port_t *jack_port_at(IWineASIOImpl *This, BOOL input, int i)
+{
+    Routing         *routing = input ? This->input_routing : This->output_routing;
+
+    if (routing)
+        return routing->ports[i];
+    return input ? This->input_channel[i].port : This->output_channel[i].port;
+}
 
+static inline void jack_latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+    IWineASIOImpl           *This = (IWineASIOImpl*)arg;
+    jack_latency_range_t    range, port_range;
+    BOOL                    capture = mode == JackCaptureLatency;
+    jack_nframes_t          added = __atomic_load_n(capture ? &This->adapter_input_latency : &This->adapter_output_latency,
+                                                    __ATOMIC_SEQ_CST);
+    int                     i;
+
+    PROBE(latency, mode);
+
+    /* Captured audio leaves through the outputs after the host, playback latency travels back the other way.
+     * Which channels the host connects is unknown, so every port gets the range of all ports on the other side. */
+    range.min = range.max = 0;
+    for (i = 0; i < jack_port_count(This, capture); i++)
+    {
+        jack_port_get_latency_range(jack_port_at(This, capture, i), mode, &port_range);
+        if (i == 0 || port_range.min < range.min)
+            range.min = port_range.min;
+        if (i == 0 || port_range.max > range.max)
+            range.max = port_range.max;
+    }
+    range.min += added;
+    range.max += added;
+    for (i = 0; i < jack_port_count(This, !capture); i++)
+        jack_port_set_latency_range(jack_port_at(This, !capture, i), mode, &range);
+    TRACE("%s latency %i-%i frames, %i added\n", capture ? "Capture" : "Playback", range.min, range.max, added);
+
+    /* JACK calls this once per direction and often several times in a row, the host hears about it once */
+    if (This->event_thread)
+        post_event(This, EventLatenciesChanged);
     return;
 }
 
 /*
- *  Actual callback called from the correct thread
+ *  Cycle timing, cheap enough to stay on in production
  */
-static inline int jack_process_callback_impl(jack_nframes_t nframes, void *arg)
+static inline unsigned long long monotonic_ns(void)
 {
-    IWineASIOImpl               *This = (IWineASIOImpl*)arg;
+    struct timespec             ts;
 
-    int                         i;
-    jack_transport_state_t      jack_transport_state;
-    jack_position_t             jack_position;
-    DWORD                       time;
+    /* kernels without the raw clock fail every call, the fallback is then used throughout */
+    if (clock_gettime(SYSTEM_CLOCK, &ts))
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    /* output silence if the ASIO callback isn't running yet */
-    if (This->asio_driver_state != Running)
-    {
-        for (i = 0; i < This->asio_active_outputs; i++)
-            bzero(jack_port_get_buffer(This->output_channel[i].port, nframes), sizeof (jack_default_audio_sample_t) * nframes);
-        return 0;
-    }
+/*
+ *  Time of the first sample of the current JACK cycle in nanoseconds of the raw monotonic clock, which Wine's
+ *  timeGetTime() and QueryPerformanceCounter() count as well and which NTP does not slew. JACK smooths its cycle times with its own DLL,
+ *  only their distance to the wake up is used, so it does not matter which clock JACK reads.
+ */
+static inline unsigned long long jack_cycle_system_time(IWineASIOImpl *This)
+{
+    jack_nframes_t              frames;
+    jack_time_t                 usecs, next_usecs;
+    float                       period_usecs;
 
-    /* copy jack to asio buffers */
-    for (i = 0; i < This->wineasio_number_inputs; i++)
-        if (This->input_channel[i].active == ASIOTrue)
-            memcpy (&This->input_channel[i].audio_buffer[nframes * This->asio_buffer_index],
-                    jack_port_get_buffer(This->input_channel[i].port, nframes),
-                    sizeof (jack_default_audio_sample_t) * nframes);
+    if (jack_get_cycle_times(This->jack_client, &frames, &usecs, &next_usecs, &period_usecs))
+        usecs = jack_frames_to_time(This->jack_client, jack_last_frame_time(This->jack_client));
 
-    if (This->asio_sample_position.lo > ULONG_MAX - nframes)
-        This->asio_sample_position.hi++;
-    This->asio_sample_position.lo += nframes;
+    /* no estimate yet on the first cycles */
+    if (!usecs || usecs > This->cycle_start || This->cycle_start - usecs > 1000000)
+        return This->timing_wake;
+    return This->timing_wake - (This->cycle_start - usecs) * 1000;
+}
 
-    time = timeGetTime();
-    This->asio_time_stamp.lo = time * 1000000;
-    This->asio_time_stamp.hi = ((unsigned long long) time * 1000000) >> 32;
+/* the nominal period is the first estimate, the loop settles within a few seconds */
+static inline void clock_reset(IWineASIOImpl *This, unsigned long long measured, jack_nframes_t nframes)
+{
+    double                      omega = 2 * M_PI * CLOCK_BANDWIDTH * nframes / This->jack_sample_rate;
+
+    This->clock_origin = measured;
+    This->clock_period = (double) nframes * 1000000000 / This->jack_sample_rate;
+    This->clock_t0 = 0;
+    This->clock_t1 = This->clock_period;
+    This->clock_b = M_SQRT2 * omega;
+    This->clock_c = omega * omega;
+    This->clock_nframes = nframes;
+    This->clock_sample_rate = This->jack_sample_rate;
+    This->clock_valid = TRUE;
+}
 
-    if (This->asio_time_info_mode) /* use the newer bufferSwitchTimeInfo method if supported */
-    {
-        This->asio_time.timeInfo.samplePosition.lo = This->asio_sample_position.lo;
-        This->asio_time.timeInfo.samplePosition.hi = This->asio_sample_position.hi;
-        This->asio_time.timeInfo.systemTime.lo = This->asio_time_stamp.lo;
-        This->asio_time.timeInfo.systemTime.hi = This->asio_time_stamp.hi;
-        This->asio_time.timeInfo.sampleRate = This->asio_sample_rate;
-        This->asio_time.timeInfo.flags = kSystemTimeValid | kSamplePositionValid | kSampleRateValid;
+/*
+ *  Feed the measured start of a cycle into the loop, returns the smoothed one and publishes the measured rate.
+ *  A new period or rate, a lost cycle or a measurement more than a period off the prediction starts over.
+ */
+static inline unsigned long long clock_update(IWineASIOImpl *This, unsigned long long measured, jack_nframes_t nframes)
+{
+    double                      error;
+    unsigned long long          shift;
 
-        if (This->asio_can_time_code) /* FIXME addionally use time code if supported */
+    if (!This->clock_valid || nframes != This->clock_nframes || This->jack_sample_rate != This->clock_sample_rate)
+        clock_reset(This, measured, nframes);
+    else
+    {
+        error = (double) (long long) (measured - This->clock_origin) - This->clock_t1;
+        if (fabs(error) > This->clock_period)
+            clock_reset(This, measured, nframes);
+        else
         {
-            jack_transport_state = jack_transport_query(This->jack_client, &jack_position);
-            This->asio_time.timeCode.flags = kTcValid;
-            if (jack_transport_state == JackTransportRolling)
-                This->asio_time.timeCode.flags |= kTcRunning;
+            This->clock_t0 = This->clock_t1;
+            This->clock_t1 += This->clock_b * error + This->clock_period;
+            This->clock_period += This->clock_c * error;
         }
-        This->asio_callbacks->bufferSwitchTimeInfo(&This->asio_time, This->asio_buffer_index, ASIOTrue);
-    }
-    else
-    { /* use the old bufferSwitch method */
-        This->asio_callbacks->bufferSwitch(This->asio_buffer_index, ASIOTrue);
     }
 
-    /* copy asio to jack buffers */
+    /* keep the doubles small so they stay sub-nanosecond precise */
+    shift = (unsigned long long) This->clock_t0;
+    This->clock_origin += shift;
+    This->clock_t0 -= shift;
+    This->clock_t1 -= shift;
+
+    __atomic_store_n(&This->statistics->clock_rate, (LONG) (nframes * 1e12 / This->clock_period), __ATOMIC_RELAXED);
+    __atomic_store_n(&This->statistics->clock_drift,
+                     (LONG) (((double) nframes * 1000000000 / This->jack_sample_rate / This->clock_period - 1) * 1e9), __ATOMIC_RELAXED);
+    return This->clock_origin;
+}
+
+static inline unsigned long long thread_cpu_ns(void)
+{
+    struct timespec             ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* single writer, the relaxed stores only keep readers from seeing torn values */
+static inline void cycle_cost_add(CycleCost *cost, LONG wall, LONG cpu)
+{
+    __atomic_store_n(&cost->wall_average, cost->wall_average + ((wall - cost->wall_average) >> COST_AVERAGE_SHIFT), __ATOMIC_RELAXED);
+    __atomic_store_n(&cost->cpu_average, cost->cpu_average + ((cpu - cost->cpu_average) >> COST_AVERAGE_SHIFT), __ATOMIC_RELAXED);
+    if (wall > cost->wall_window_maximum)
+    {
+        cost->wall_window_maximum = wall;
+        if (wall > cost->wall_maximum)
+            __atomic_store_n(&cost->wall_maximum, wall, __ATOMIC_RELAXED);
+    }
+    if (cpu > cost->cpu_window_maximum)
+    {
+        cost->cpu_window_maximum = cpu;
+        if (cpu > cost->cpu_maximum)
+            __atomic_store_n(&cost->cpu_maximum, cpu, __ATOMIC_RELAXED);
+    }
+}
+
+/* One read() of the whole group, in the order of the Counter enum. When the kernel multiplexed
+ * the group with other events it only counted part of the time, the counts are scaled up to all of it. */
+static inline BOOL perf_counters_read(IWineASIOImpl *This, unsigned long long *values)
+{
+    unsigned long long          group[3 + CounterCount];
+    double                      scale;
+    int                         i;
+
+    if (read(This->perf_group, group, sizeof(group)) < (ssize_t) ((3 + This->perf_members) * sizeof(group[0])) || !group[2])
+        return FALSE;
+    scale = group[2] < group[1] ? (double) group[1] / group[2] : 1.0;
+    for (i = 0; i < CounterCount; i++)
+        values[i] = This->perf_slot[i] >= 0 ? (unsigned long long) (group[3 + This->perf_slot[i]] * scale) : 0;
+    return TRUE;
+}
+
+/* the thread id is only looked up once per thread */
+static inline int perf_thread_id(void)
+{
+    static __thread int         tid;
+
+    if (!tid)
+        tid = syscall(SYS_gettid);
+    return tid;
+}
+
+/*
+ *  Snapshot the counters when the processing thread wakes. A new thread has its counters
+ *  opened by the event thread, the cycles until then go uncounted.
+ */
+static inline void perf_counters_start(IWineASIOImpl *This)
+{
+    int                         tid;
+
+    This->perf_active = FALSE;
+    if (!This->wineasio_performance_counters)
+        return;
+
+    tid = perf_thread_id();
+    if (__atomic_load_n(&This->perf_tid, __ATOMIC_ACQUIRE) != tid)
+    {
+        if (This->perf_request_tid != tid && This->event_thread)
+        {
+            This->perf_request_tid = tid;
+            post_event(This, EventPerfCounters);
+        }
+        return;
+    }
+    memset(This->perf_host, 0, sizeof(This->perf_host));
+    This->perf_active = perf_counters_read(This, This->perf_start);
+}
+
+/* the host gets the counts from entering until the last leave, the driver the rest of the cycle */
+static inline void perf_counters_account(IWineASIOImpl *This)
+{
+    Statistics                  *statistics = This->statistics;
+    unsigned long long          end[CounterCount];
+    int                         i;
+
+    if (!This->perf_active || !perf_counters_read(This, end))
+        return;
+    for (i = 0; i < CounterCount; i++)
+    {
+        __atomic_store_n(&statistics->counter_driver[i],
+                         statistics->counter_driver[i] + end[i] - This->perf_start[i] - This->perf_host[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&statistics->counter_host[i], statistics->counter_host[i] + This->perf_host[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&statistics->counted_cycles, statistics->counted_cycles + 1, __ATOMIC_RELAXED);
+}
+
+/* the host runs outside of the JACK cycle on the asynchronous thread, only the per call histogram is kept then */
+static inline unsigned long long timing_host_enter(IWineASIOImpl *This)
+{
+    if (GetCurrentThreadId() == This->async_thread_id)
+        return monotonic_ns();
+
+    /* read before the clock, so the read itself is not booked to the host, a failed read drops the cycle */
+    if (This->perf_active)
+        This->perf_active = perf_counters_read(This, This->perf_call);
+
+    This->timing_call_cpu = thread_cpu_ns();
+    This->timing_call = monotonic_ns();
+    if (!This->timing_switch_enter)
+    {
+        This->timing_switch_enter = This->timing_call;
+        This->timing_switch_enter_cpu = This->timing_call_cpu;
+    }
+    return This->timing_call;
+}
+
+/* books the host time since entering or the last call, OutputReady() may book part of a bufferSwitch early */
+static inline void timing_host_leave(IWineASIOImpl *This, unsigned long long now)
+{
+    unsigned long long          cpu, counters[CounterCount];
+    int                         i;
+
+    if (GetCurrentThreadId() == This->async_thread_id)
+        return;
+
+    cpu = thread_cpu_ns();
+    This->timing_host += now - This->timing_call;
+    This->timing_host_cpu += cpu - This->timing_call_cpu;
+    This->timing_switch_exit = This->timing_call = now;
+    This->timing_call_cpu = cpu;
+
+    if (This->perf_active)
+    {
+        This->perf_active = perf_counters_read(This, counters);
+        for (i = 0; This->perf_active && i < CounterCount; i++)
+        {
+            This->perf_host[i] += counters[i] - This->perf_call[i];
+            This->perf_call[i] = counters[i];
+        }
+    }
+}
+
+static inline void histogram_add(Histogram *histogram, unsigned long long ns)
+{
+    int                         bucket, e;
+
+    if (ns < 4)
+    {
+        bucket = ns;
+    }
+    else
+    {
+        e = 63 - __builtin_clzll(ns);
+        bucket = (e - 1) * 4 + ((ns >> (e - 2)) & 3);
+        if (bucket >= HISTOGRAM_BUCKETS)
+            bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_store_n(&histogram->count[bucket], histogram->count[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Hand one ASIO buffer to the host, the sample position advances by its length
+ *  and system_time is the time of its first sample in nanoseconds
+ */
+static inline void asio_buffer_switch(IWineASIOImpl *This, LONG frames, unsigned long long system_time, LONG offset)
+{
+    IOChannel                   *loopback;
+    unsigned long long          switch_enter, switch_exit, jump, position;
+    int                         i;
+
+    /* the loopback inputs get what the host wrote to their outputs in the previous buffer */
+    for (i = 0; i < This->wineasio_number_loopbacks; i++)
+    {
+        loopback = &This->input_channel[This->wineasio_number_inputs + i];
+        if (loopback->active == ASIOTrue)
+            channel_copy(loopback, &loopback->audio_buffer[frames * This->asio_buffer_index],
+                         &This->output_channel[This->wineasio_loopback_source + i].audio_buffer[frames * !This->asio_buffer_index], frames);
+    }
+
+    /* a timeline jump seen by the JACK thread, the asynchronous thread may be the one owning the position */
+    jump = __atomic_exchange_n(&This->asio_sample_jump, 0, __ATOMIC_SEQ_CST);
+    position = ((unsigned long long) This->asio_sample_position.hi << 32 | This->asio_sample_position.lo) + jump + frames;
+    This->asio_sample_position.lo = position;
+    This->asio_sample_position.hi = position >> 32;
+    if (jump)
+        This->statistics->discontinuity_position = position;
+
+    This->asio_time_stamp.lo = system_time;
+    This->asio_time_stamp.hi = system_time >> 32;
+    snapshot_publish(&This->position, (unsigned long long) This->asio_sample_position.hi << 32 | This->asio_sample_position.lo, system_time);
+
+    if (This->asio_time_info_mode) /* use the newer bufferSwitchTimeInfo method if supported */
+    {
+        This->asio_time.timeInfo.samplePosition.lo = This->asio_sample_position.lo;
+        This->asio_time.timeInfo.samplePosition.hi = This->asio_sample_position.hi;
+        This->asio_time.timeInfo.systemTime.lo = This->asio_time_stamp.lo;
+        This->asio_time.timeInfo.systemTime.hi = This->asio_time_stamp.hi;
+        /* the rate the clock actually runs at, the host converts between samples and system time with it */
+        This->asio_time.timeInfo.sampleRate = This->asio_sample_rate
+                * (1.0 + __atomic_load_n(&This->statistics->clock_drift, __ATOMIC_RELAXED) / 1e9);
+        This->asio_time.timeInfo.flags = kSystemTimeValid | kSamplePositionValid | kSampleRateValid;
+
+        if (This->asio_can_time_code) /* addionally use time code if supported */
+            transport_time_code(This, offset);
+        trace_event(This, "bufferSwitch", 'B', "index", This->asio_buffer_index);
+        PROBE(buffer_switch_enter, This->asio_buffer_index, frames,
+              (unsigned long long) This->asio_sample_position.hi << 32 | This->asio_sample_position.lo);
+        switch_enter = timing_host_enter(This);
+        This->asio_callbacks->bufferSwitchTimeInfo(&This->asio_time, This->asio_buffer_index, ASIOTrue);
+    }
+    else
+    { /* use the old bufferSwitch method */
+        trace_event(This, "bufferSwitch", 'B', "index", This->asio_buffer_index);
+        PROBE(buffer_switch_enter, This->asio_buffer_index, frames,
+              (unsigned long long) This->asio_sample_position.hi << 32 | This->asio_sample_position.lo);
+        switch_enter = timing_host_enter(This);
+        This->asio_callbacks->bufferSwitch(This->asio_buffer_index, ASIOTrue);
+    }
+    switch_exit = monotonic_ns();
+    trace_event(This, "bufferSwitch", 'E', NULL, 0);
+    PROBE(buffer_switch_exit, This->asio_buffer_index, frames,
+          (unsigned long long) This->asio_sample_position.hi << 32 | This->asio_sample_position.lo, switch_exit - switch_enter);
+    histogram_add(&This->statistics->timing[TimingHost], switch_exit - switch_enter);
+    timing_host_leave(This, switch_exit);
+}
+
+/*
+ *  Run the host on every complete ASIO buffer waiting in the input ring
+ */
+static inline void period_adapter_run(IWineASIOImpl *This, PeriodAdapter *adapter)
+{
+    LONG                        asio_frames = This->asio_current_buffersize;
+    unsigned long long          stamp_position, stamp_time, system_time;
+    LONG                        offset;
+    int                         i;
+
+    while (audio_ring_readable(&adapter->input_ring) >= asio_frames
+            && __atomic_load_n(&This->asio_driver_state, __ATOMIC_SEQ_CST) == Running)
+    {
+        /* A buffer starts where it sits in the ring relative to the latest JACK period, earlier for one that waited.
+         * Over the few periods the ring holds the nominal rate is close enough. */
+        snapshot_read(&adapter->input_stamp, &stamp_position, &stamp_time);
+        offset = (INT) (adapter->input_ring.read_pos - (unsigned int) stamp_position);
+        system_time = stamp_time + (long long) (offset * 1e9 / This->asio_sample_rate);
+
+        for (i = 0; i < This->wineasio_number_inputs; i++)
+            if (This->input_channel[i].active == ASIOTrue)
+                audio_ring_read(&adapter->input_ring, i,
+                        &This->input_channel[i].audio_buffer[asio_frames * This->asio_buffer_index], asio_frames, NULL);
+        audio_ring_read_advance(&adapter->input_ring, asio_frames);
+
+        /* the JACK cycle can only be finished early from its last buffer, never from the asynchronous thread */
+        This->output_ready_armed = !adapter->threaded && audio_ring_readable(&adapter->input_ring) < asio_frames;
+        asio_buffer_switch(This, asio_frames, system_time, offset);
+        This->output_ready_armed = FALSE;
+
+        /* the host may have stopped, or from the asynchronous thread even disposed the adapter, within the switch */
+        if (__atomic_load_n(&This->asio_driver_state, __ATOMIC_SEQ_CST) != Running
+                || __atomic_load_n(&This->period_adapter, __ATOMIC_SEQ_CST) != adapter)
+            break;
+
+        if (!This->output_ready_done)
+            period_adapter_ring_write(This, adapter);
+
+        /* swith asio buffer */
+        This->asio_buffer_index = This->asio_buffer_index ? 0 : 1;
+    }
+}
+
+/*
+ *  Queue the ASIO buffer the host just filled, into the adapter its input came from
+ */
+static inline void period_adapter_ring_write(IWineASIOImpl *This, PeriodAdapter *adapter)
+{
+    LONG                        asio_frames = This->asio_current_buffersize;
+    int                         i;
+
+    if (audio_ring_writable(&adapter->output_ring) < asio_frames)
+        return;
+
+    for (i = 0; i < This->wineasio_number_outputs; i++)
+        if (This->output_channel[i].active == ASIOTrue)
+            audio_ring_write(&adapter->output_ring, i,
+                    &This->output_channel[i].audio_buffer[asio_frames * This->asio_buffer_index], asio_frames, NULL);
+    audio_ring_write_advance(&adapter->output_ring, asio_frames);
+}
+
+/*
+ *  Convert a JACK period of input to the ASIO rate and queue it
+ */
+static inline void period_adapter_resample_input(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    PeriodAdapter               *adapter = This->period_adapter;
+    Resampler                   *rs = &adapter->input_resampler;
+    unsigned int                outputs;
+    int                         i;
+
+    if (rs->fill + nframes > rs->capacity)
+    {
+        period_adapter_input_overrun(This, rs->capacity - rs->fill, nframes);
+        return;
+    }
+
+    for (i = 0; i < This->wineasio_number_inputs; i++)
+        if (This->input_channel[i].active == ASIOTrue)
+            channel_copy(&This->input_channel[i], resampler_input(rs, i), This->input_channel[i].port_buffer, nframes);
+    resampler_input_advance(rs, nframes);
+
+    outputs = resampler_outputs_available(rs);
+    if (outputs > adapter->resampler_scratch_frames)
+        outputs = adapter->resampler_scratch_frames;
+    if (outputs > audio_ring_writable(&adapter->input_ring))
+    {
+        period_adapter_input_overrun(This, audio_ring_writable(&adapter->input_ring), outputs);
+        outputs = audio_ring_writable(&adapter->input_ring);
+    }
+
+    for (i = 0; i < This->wineasio_number_inputs; i++)
+        if (This->input_channel[i].active == ASIOTrue)
+        {
+            resampler_run(rs, i, adapter->resampler_scratch, outputs);
+            audio_ring_write(&adapter->input_ring, i, adapter->resampler_scratch, outputs, NULL);
+        }
+    resampler_advance(rs, outputs);
+    audio_ring_write_advance(&adapter->input_ring, outputs);
+}
+
+/*
+ *  Fill a JACK period of output from the queue, converted from the ASIO rate
+ */
+static inline void period_adapter_resample_output(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    PeriodAdapter               *adapter = This->period_adapter;
+    Resampler                   *rs = &adapter->output_resampler;
+    unsigned int                needed = resampler_input_needed(rs, nframes);
+    int                         i;
+
+    if (audio_ring_readable(&adapter->output_ring) < needed || rs->fill + needed > rs->capacity)
+    {
+        __atomic_add_fetch(&This->statistics->late_callbacks, 1, __ATOMIC_RELAXED);
+        LOG_RT(LogAudio, LogInfo, "The host had %i of %i frames ready, the JACK period is silent\n",
+               audio_ring_readable(&adapter->output_ring), needed);
+        post_event(This, EventOverload);
+        for (i = 0; i < This->wineasio_number_outputs; i++)
+            if (This->output_channel[i].active == ASIOTrue)
+                bzero(This->output_channel[i].port_buffer, sizeof (jack_default_audio_sample_t) * nframes);
+        return;
+    }
+
+    for (i = 0; i < This->wineasio_number_outputs; i++)
+        if (This->output_channel[i].active == ASIOTrue)
+            audio_ring_read(&adapter->output_ring, i, resampler_input(rs, i), needed, &This->output_channel[i]);
+    audio_ring_read_advance(&adapter->output_ring, needed);
+    resampler_input_advance(rs, needed);
+
+    for (i = 0; i < This->wineasio_number_outputs; i++)
+        if (This->output_channel[i].active == ASIOTrue)
+            resampler_run(rs, i, This->output_channel[i].port_buffer, nframes);
+    resampler_advance(rs, nframes);
+}
+
+/*
+ *  Copy the ASIO buffer the host just filled to its slice of the JACK period
+ */
+static inline void period_adapter_slice_output(IWineASIOImpl *This, LONG offset)
+{
+    LONG                        asio_frames = This->asio_current_buffersize;
+    int                         i;
+
     for (i = 0; i < This->wineasio_number_outputs; i++)
         if (This->output_channel[i].active == ASIOTrue)
-            memcpy(jack_port_get_buffer(This->output_channel[i].port, nframes),
-                    &This->output_channel[i].audio_buffer[nframes * This->asio_buffer_index],
-                    sizeof (jack_default_audio_sample_t) * nframes);
+            channel_copy(&This->output_channel[i],
+                    This->output_channel[i].port_buffer + offset,
+                    &This->output_channel[i].audio_buffer[asio_frames * This->asio_buffer_index], asio_frames);
+}
+
+/*
+ *  AdapterSlice: the JACK period holds a whole number of ASIO buffers, run the host on each slice in turn
+ */
+static inline void period_adapter_process_slices(IWineASIOImpl *This, jack_nframes_t nframes, unsigned long long system_time)
+{
+    PeriodAdapter               *adapter = This->period_adapter;
+    LONG                        asio_frames = This->asio_current_buffersize;
+    int                         i, j;
+
+    /* JACK changed its period and the host did not recreate its buffers yet, or is still busy in a threaded adapter */
+    if (nframes != asio_frames * adapter->slices || __atomic_load_n(&This->async_busy, __ATOMIC_SEQ_CST))
+    {
+        for (i = 0; i < This->wineasio_number_outputs; i++)
+            if (This->output_channel[i].active == ASIOTrue)
+                bzero(This->output_channel[i].port_buffer, sizeof (jack_default_audio_sample_t) * nframes);
+        return;
+    }
+
+    for (j = 0; j < adapter->slices; j++)
+    {
+        /* copy jack to asio buffers */
+        for (i = 0; i < This->wineasio_number_inputs; i++)
+            if (This->input_channel[i].active == ASIOTrue)
+                channel_copy(&This->input_channel[i],
+                        &This->input_channel[i].audio_buffer[asio_frames * This->asio_buffer_index],
+                        This->input_channel[i].port_buffer + asio_frames * j, asio_frames);
+
+        This->output_ready_armed = j == adapter->slices - 1;
+        asio_buffer_switch(This, asio_frames, system_time + (unsigned long long) (This->clock_period * j / adapter->slices), asio_frames * j);
+        This->output_ready_armed = FALSE;
+
+        if (!This->output_ready_done)
+            period_adapter_slice_output(This, asio_frames * j);
+
+        /* swith asio buffer */
+        This->asio_buffer_index = This->asio_buffer_index ? 0 : 1;
+    }
+}
+
+/*
+ *  AdapterRing: queue the JACK period, run as many ASIO buffers as are complete
+ */
+static inline void period_adapter_process_ring(IWineASIOImpl *This, jack_nframes_t nframes, unsigned long long system_time)
+{
+    PeriodAdapter               *adapter = This->period_adapter;
+    unsigned int                position = adapter->input_ring.write_pos;
+    int                         i;
+
+    if (adapter->resampling)
+    {
+        period_adapter_resample_input(This, nframes);
+    }
+    else if (audio_ring_writable(&adapter->input_ring) >= nframes)
+    {
+        for (i = 0; i < This->wineasio_number_inputs; i++)
+            if (This->input_channel[i].active == ASIOTrue)
+                audio_ring_write(&adapter->input_ring, i, This->input_channel[i].port_buffer, nframes, &This->input_channel[i]);
+        audio_ring_write_advance(&adapter->input_ring, nframes);
+    }
+    else
+    {
+        period_adapter_input_overrun(This, audio_ring_writable(&adapter->input_ring), nframes);
+    }
+    snapshot_publish(&adapter->input_stamp, position, system_time);
+
+    /* A threaded host catches up on its own thread while JACK carries on.
+     * Right after a swap from a threaded adapter it may still be in the old one, it is not run twice at once. */
+    if (adapter->threaded)
+        sem_post(&This->async_semaphore);
+    else if (!__atomic_load_n(&This->async_busy, __ATOMIC_SEQ_CST))
+        period_adapter_run(This, adapter);
+
+    if (!This->output_ready_done)
+        period_adapter_ring_output(This, nframes);
+}
+
+/*
+ *  The host fell so far behind that the input queue is full, JACK input is lost like output on an underrun
+ */
+static inline void period_adapter_input_overrun(IWineASIOImpl *This, unsigned int room, unsigned int frames)
+{
+    __atomic_add_fetch(&This->statistics->late_callbacks, 1, __ATOMIC_RELAXED);
+    LOG_RT(LogAudio, LogInfo, "The input queue had room for %i of %i frames, the JACK input is dropped\n", room, frames);
+    post_event(This, EventOverload);
+}
+
+/*
+ *  Fill the JACK period from the output queue
+ */
+static inline void period_adapter_ring_output(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    PeriodAdapter               *adapter = This->period_adapter;
+    int                         i;
+
+    /* the output ring is primed with the adapter latency, so this only runs dry after an overload */
+    if (adapter->resampling)
+    {
+        period_adapter_resample_output(This, nframes);
+    }
+    else if (audio_ring_readable(&adapter->output_ring) >= nframes)
+    {
+        for (i = 0; i < This->wineasio_number_outputs; i++)
+            if (This->output_channel[i].active == ASIOTrue)
+                audio_ring_read(&adapter->output_ring, i, This->output_channel[i].port_buffer, nframes, &This->output_channel[i]);
+        audio_ring_read_advance(&adapter->output_ring, nframes);
+    }
+    else
+    {
+        __atomic_add_fetch(&This->statistics->late_callbacks, 1, __ATOMIC_RELAXED);
+        LOG_RT(LogAudio, LogInfo, "The host had %i of %i frames ready, the JACK period is silent\n",
+               audio_ring_readable(&adapter->output_ring), nframes);
+        post_event(This, EventOverload);
+        for (i = 0; i < This->wineasio_number_outputs; i++)
+            if (This->output_channel[i].active == ASIOTrue)
+                bzero(This->output_channel[i].port_buffer, sizeof (jack_default_audio_sample_t) * nframes);
+    }
+}
+
+/*
+ *  Direct monitoring, mix the monitored inputs into their outputs after the host wrote them
+ */
+static inline void input_monitor_mix(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    IOChannel                   *output;
+    jack_default_audio_sample_t *input;
+    LONG                        target;
+    float                       gain, pan;
+    int                         i;
+
+    for (i = 0; i < This->wineasio_number_inputs; i++)
+    {
+        target = __atomic_load_n(&This->input_channel[i].monitor_output, __ATOMIC_ACQUIRE);
+        if (target < 0)
+            continue;
+
+        /* constant power pan across the output pair starting at the target, 0 is left */
+        gain = (float) __atomic_load_n(&This->input_channel[i].monitor_gain, __ATOMIC_RELAXED) / ASIO_GAIN_UNITY;
+        pan = (float) __atomic_load_n(&This->input_channel[i].monitor_pan, __ATOMIC_RELAXED) / 0x7fffffff * M_PI_2;
+        if (target + 1 >= This->wineasio_number_outputs)
+            pan = 0.0f;
+
+        /* routed inputs were already mixed into their scratch buffer */
+        if (This->input_routing)
+            input = This->input_channel[i].port_buffer;
+        else
+            input = jack_port_get_buffer(This->input_channel[i].port, nframes);
+
+        output = &This->output_channel[target];
+        if (output->active == ASIOTrue)
+            channel_mix(output->port_buffer, input, gain * cosf(pan), nframes);
+        output = &This->output_channel[target + 1];
+        if (pan != 0.0f && output->active == ASIOTrue)
+            channel_mix(output->port_buffer, input, gain * sinf(pan), nframes);
+    }
+}
+
+/*
+ *  Routing matrix, every entry is one SIMD multiply-add of a whole period
+ */
+static inline void routing_mix_inputs(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    Routing                     *routing = This->input_routing;
+    RoutingEntry                *entry;
+    int                         i;
+
+    for (i = 0; i < routing->num_ports; i++)
+        routing->port_buffers[i] = jack_port_get_buffer(routing->ports[i], nframes);
+    for (i = 0; i < This->wineasio_number_inputs; i++)
+        bzero(This->input_channel[i].port_buffer, sizeof (jack_default_audio_sample_t) * nframes);
+    for (entry = routing->entries; entry < routing->entries + routing->num_entries; entry++)
+        channel_mix(This->input_channel[entry->channel].port_buffer, routing->port_buffers[entry->port], entry->gain, nframes);
+}
+
+static inline void routing_mix_outputs(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    Routing                     *routing = This->output_routing;
+    RoutingEntry                *entry;
+    int                         i;
+
+    for (i = 0; i < routing->num_ports; i++)
+    {
+        routing->port_buffers[i] = jack_port_get_buffer(routing->ports[i], nframes);
+        bzero(routing->port_buffers[i], sizeof (jack_default_audio_sample_t) * nframes);
+    }
+    /* channels the host did not activate hold stale scratch */
+    for (entry = routing->entries; entry < routing->entries + routing->num_entries; entry++)
+        if (This->output_channel[entry->channel].active == ASIOTrue)
+            channel_mix(routing->port_buffers[entry->port], This->output_channel[entry->channel].port_buffer, entry->gain, nframes);
+}
+
+/*
+ *  JACK frame time advances by exactly one period per cycle unless cycles were lost. Across a gap the
+ *  sample position jumps by the lost frames, so it stays on the JACK timeline, and the host is asked to resync.
+ */
+static inline void jack_timeline_check(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    jack_nframes_t              frame_time = jack_last_frame_time(This->jack_client);
+    int                         lost = (int) (frame_time - This->cycle_frame_time - This->cycle_nframes);
+
+    if (This->cycle_frame_time_valid && lost > 0)
+    {
+        __atomic_add_fetch(&This->asio_sample_jump, (unsigned long long) lost * This->asio_sample_rate / This->jack_sample_rate,
+                           __ATOMIC_SEQ_CST);
+        This->clock_valid = FALSE;
+        This->transport_resync = TRUE;
+        __atomic_add_fetch(&This->statistics->discontinuities, 1, __ATOMIC_RELAXED);
+        trace_event(This, "discontinuity", 'i', "lost_frames", lost);
+        LOG_RT(LogAudio, LogInfo, "JACK timeline jumped over %i frames, resyncing the host\n", lost);
+        post_event(This, EventResync);
+    }
+    This->cycle_frame_time = frame_time;
+    This->cycle_nframes = nframes;
+    This->cycle_frame_time_valid = TRUE;
+}
+
+/*
+ *  Follow the transport at the start of a cycle, from the last locate on by the length of every cycle that rolled.
+ *  Only the state is queried each cycle, which does not copy the whole position.
+ */
+static inline void transport_update(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    unsigned long long          locate = __atomic_load_n(&This->transport_locate, __ATOMIC_ACQUIRE);
+    jack_position_t             position;
+    jack_transport_state_t      state;
+
+    if (This->transport_resync)
+    {
+        state = jack_transport_query(This->jack_client, &position);
+        __atomic_store_n(&This->transport_frame, position.frame, __ATOMIC_RELAXED);
+        This->transport_resync = FALSE;
+    }
+    else
+    {
+        state = jack_transport_query(This->jack_client, NULL);
+        if ((LONG) (locate >> 32) != This->transport_located)
+            __atomic_store_n(&This->transport_frame, (jack_nframes_t) locate, __ATOMIC_RELAXED);
+        else if (This->transport_rolling)
+            __atomic_store_n(&This->transport_frame, This->transport_frame + This->transport_nframes, __ATOMIC_RELAXED);
+    }
+    This->transport_located = locate >> 32;
+    This->transport_nframes = nframes;
+    __atomic_store_n(&This->transport_rolling, state == JackTransportRolling, __ATOMIC_RELAXED);
+}
+
+/* The time code of the buffer about to be handed to the host, in ASIO samples. The buffer starts offset frames
+ * after the latest JACK cycle, a buffer taken from the input ring started that much before it. */
+static inline void transport_time_code(IWineASIOImpl *This, LONG offset)
+{
+    BOOL                        rolling = __atomic_load_n(&This->transport_rolling, __ATOMIC_RELAXED);
+    unsigned long long          samples;
+
+    samples = (unsigned long long) __atomic_load_n(&This->transport_frame, __ATOMIC_RELAXED) * This->asio_sample_rate / This->jack_sample_rate;
+    if (rolling)
+        samples = offset < 0 && (unsigned long long) -offset > samples ? 0 : samples + offset;
+
+    This->asio_time.timeCode.speed = rolling ? 1.0 : 0.0;
+    This->asio_time.timeCode.timeCodeSamples.lo = samples;
+    This->asio_time.timeCode.timeCodeSamples.hi = samples >> 32;
+    This->asio_time.timeCode.flags = kTcValid | kTcSpeedValid | (rolling ? kTcRunning | kTcOnspeed : kTcStill);
+}
+
+/*
+ *  Actual callback called from the correct thread
+ */
+static inline int jack_process_callback_impl(jack_nframes_t nframes, void *arg)
+{
+    IWineASIOImpl               *This = (IWineASIOImpl*)arg;
+    PeriodAdapter               *adapter;
+    unsigned long long          system_time;
+    int                         i;
+
+    /* swap in an adapter built for a new JACK period, the old one is freed by whoever built this one */
+    if (__atomic_load_n(&This->pending_adapter, __ATOMIC_ACQUIRE))
+    {
+        adapter = __atomic_exchange_n(&This->pending_adapter, NULL, __ATOMIC_SEQ_CST);
+        if (adapter)
+        {
+            __atomic_store_n(&This->retired_adapter, This->period_adapter, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&This->period_adapter, adapter, __ATOMIC_SEQ_CST);
+        }
+    }
+    adapter = This->period_adapter;
+
+    /* output silence if the ASIO callback isn't running yet, or the period outgrew the routing scratch */
+    if (This->asio_driver_state != Running
+        || ((This->input_routing || This->output_routing) && nframes > ASIO_MAXIMUM_BUFFERSIZE))
+    {
+        if (This->output_routing)
+            for (i = 0; i < This->output_routing->num_ports; i++)
+                bzero(jack_port_get_buffer(This->output_routing->ports[i], nframes), sizeof (jack_default_audio_sample_t) * nframes);
+        else
+            for (i = 0; i < This->asio_active_outputs; i++)
+                bzero(jack_port_get_buffer(This->output_channel[i].port, nframes), sizeof (jack_default_audio_sample_t) * nframes);
+        return 0;
+    }
+
+    /* routed channels keep their scratch buffer */
+    if (This->input_routing)
+        routing_mix_inputs(This, nframes);
+    else
+        for (i = 0; i < This->wineasio_number_inputs; i++)
+            if (This->input_channel[i].active == ASIOTrue)
+                This->input_channel[i].port_buffer = jack_port_get_buffer(This->input_channel[i].port, nframes);
+    if (!This->output_routing)
+        for (i = 0; i < This->wineasio_number_outputs; i++)
+            if (This->output_channel[i].active == ASIOTrue)
+                This->output_channel[i].port_buffer = jack_port_get_buffer(This->output_channel[i].port, nframes);
+
+    if (This->adapter_reset_pending)
+    {
+        period_adapter_reset(adapter);
+        This->adapter_reset_pending = FALSE;
+    }
+
+    This->cycle_start = jack_get_time();
+    This->timing_wake = monotonic_ns();
+    This->timing_wake_cpu = thread_cpu_ns();
+    This->timing_switch_enter = 0;
+    This->timing_host = This->timing_host_cpu = 0;
+    perf_counters_start(This);
+    jack_timeline_check(This, nframes);
+    if (This->asio_can_time_code)
+        transport_update(This, nframes);
+
+    system_time = clock_update(This, jack_cycle_system_time(This), nframes);
+    This->output_ready_nframes = nframes;
+    This->output_ready_done = FALSE;
+
+    if (adapter->mode == AdapterSlice)
+        period_adapter_process_slices(This, nframes, system_time);
+    else
+        period_adapter_process_ring(This, nframes, system_time);
+
+    /* unless OutputReady() already did */
+    if (!This->output_ready_done)
+        jack_process_finish(This, nframes);
+    return 0;
+}
+
+/*
+ *  The rest of the JACK cycle once the host outputs are in the port buffers,
+ *  after this the JACK thread may carry on while the host is still busy
+ */
+static inline void jack_process_finish(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    jack_time_t                 elapsed;
+
+    input_monitor_mix(This, nframes);
+    if (This->output_routing)
+        routing_mix_outputs(This, nframes);
+
+    elapsed = jack_get_time() - This->cycle_start;
+    if (elapsed * This->jack_sample_rate > (jack_time_t) nframes * 1000000)
+    {
+        __atomic_add_fetch(&This->statistics->missed_deadlines, 1, __ATOMIC_RELAXED);
+        trace_event(This, "missed deadline", 'i', NULL, 0);
+        LOG_RT(LogAudio, LogInfo, "Cycle of %i frames took %i us\n", nframes, (LONG) elapsed);
+        post_event(This, EventOverload);
+    }
+
+    if (jack_sync_privates.wine_thread != NULL && !jack_sync_privates.released)
+    {
+        jack_sync_privates.released = 1;
+        trace_event(This, "release", 'i', NULL, 0);
+        PROBE(sync_release, nframes);
+        sem_post(&jack_sync_privates.jack_semaphore);
+    }
+
+    jack_process_account(This, nframes);
+}
+
+/*
+ *  Book the cycle that just finished into the histograms and the cost breakdown
+ */
+static inline void jack_process_account(IWineASIOImpl *This, jack_nframes_t nframes)
+{
+    Statistics                  *statistics = This->statistics;
+    unsigned long long          done = monotonic_ns(), done_cpu = thread_cpu_ns();
+    unsigned long long          input, input_cpu;
+    int                         i;
+
+    if (!This->timing_switch_enter)
+    {
+        This->timing_switch_enter = This->timing_switch_exit = done;
+        This->timing_switch_enter_cpu = done_cpu;
+    }
+    else
+    {
+        histogram_add(&statistics->timing[TimingInput], This->timing_switch_enter - This->timing_wake);
+        histogram_add(&statistics->timing[TimingOutput], done - This->timing_switch_exit);
+    }
+    histogram_add(&statistics->timing[TimingWake], This->timing_wake - This->timing_start);
+    histogram_add(&statistics->timing[TimingCycle], done - This->timing_start);
+
+    input = This->timing_switch_enter - This->timing_wake;
+    input_cpu = This->timing_switch_enter_cpu - This->timing_wake_cpu;
+    cycle_cost_add(&statistics->cost[CostWake], This->timing_wake - This->timing_start, 0);
+    cycle_cost_add(&statistics->cost[CostInput], input, input_cpu);
+    cycle_cost_add(&statistics->cost[CostHost], This->timing_host, This->timing_host_cpu);
+    cycle_cost_add(&statistics->cost[CostOutput], done - This->timing_wake - input - This->timing_host,
+                   done_cpu - This->timing_wake_cpu - input_cpu - This->timing_host_cpu);
+    cycle_cost_add(&statistics->cost[CostCycle], done - This->timing_start, done_cpu - This->timing_wake_cpu);
+
+    /* a new maximum shows right away and stays for the rest of the window and the whole next one */
+    if (++statistics->cost_cycles % COST_WINDOW == 0)
+    {
+        for (i = 0; i < CostCount; i++)
+        {
+            __atomic_store_n(&statistics->cost[i].wall_maximum, statistics->cost[i].wall_window_maximum, __ATOMIC_RELAXED);
+            __atomic_store_n(&statistics->cost[i].cpu_maximum, statistics->cost[i].cpu_window_maximum, __ATOMIC_RELAXED);
+            statistics->cost[i].wall_window_maximum = statistics->cost[i].cpu_window_maximum = 0;
+        }
+    }
+    __atomic_store_n(&statistics->period_budget, (LONG) ((unsigned long long) nframes * 1000000000 / This->jack_sample_rate), __ATOMIC_RELAXED);
+
+    perf_counters_account(This);
+    shared_statistics_cycle(This);
+    PROBE(cycle_account, nframes, done - This->timing_start, This->timing_wake - This->timing_start,
+          This->timing_host, done_cpu - This->timing_wake_cpu);
+}
+
+/*
+ * Own sync thread only used to keep both in sync
+ */
+static DWORD WINAPI jack_sync_thread_function(LPVOID arg)
+{
+    struct sched_param param;
+
+    jack_sync_privates.wine_pthread = pthread_self();
+
+    // Try to prioritize thread
+    // int max_priority = sched_get_priority_max(SCHED_FIFO);
+    param.sched_priority = 95;
+    pthread_setschedparam(
+        jack_sync_privates.wine_pthread, SCHED_FIFO, &param);
+    
+    while (jack_sync_privates.running == 1) {
+        // wait until jack has called
+        jack_sync_privates.wine_thread_busy = 0;
+        while (sem_wait(&jack_sync_privates.wine_semaphore) && errno == EINTR)
+            ;
+        if (jack_sync_privates.running != 1)
+            break;
+        jack_sync_privates.wine_thread_busy = 1;
+        jack_sync_privates.released = 0;
+        trace_event(jack_sync_privates.arg, "wake", 'i', NULL, 0);
+        PROBE(sync_wake, jack_sync_privates.nframes);
+        jack_process_callback_impl(
+            jack_sync_privates.nframes,
+            jack_sync_privates.arg
+        );
+        // Wake the jack thread again, unless OutputReady already did
+        if (!jack_sync_privates.released)
+        {
+            trace_event(jack_sync_privates.arg, "release", 'i', NULL, 0);
+            PROBE(sync_release, jack_sync_privates.nframes);
+            sem_post(&jack_sync_privates.jack_semaphore);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread running the host for threaded adapters, woken once per JACK period
+ */
+static DWORD WINAPI asio_async_thread_function(LPVOID arg)
+{
+    IWineASIOImpl       *This = (IWineASIOImpl*)arg;
+    PeriodAdapter       *adapter;
+    struct sched_param  param;
+
+    /* just below JACK so the process thread is never preempted by the host */
+    param.sched_priority = jack_client_real_time_priority(This->jack_client) - 1;
+    if (param.sched_priority > 0)
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    do
+    {
+        sem_wait(&This->async_semaphore);
+        if (async_thread_disposed(This))
+            break;
+        /* busy before looking at the adapter, the JACK thread only runs the host itself while this is not */
+        __atomic_store_n(&This->async_busy, TRUE, __ATOMIC_SEQ_CST);
+        adapter = __atomic_load_n(&This->period_adapter, __ATOMIC_SEQ_CST);
+        if (adapter->threaded)
+            period_adapter_run(This, adapter);
+        __atomic_store_n(&This->async_busy, FALSE, __ATOMIC_SEQ_CST);
+    }
+    while (!async_thread_disposed(This));
+    return 0;
+}
+
+/* a thread the host disposed its buffers from is not waited for, it leaves as soon as the host returns */
+static inline BOOL async_thread_disposed(IWineASIOImpl *This)
+{
+    return !__atomic_load_n(&This->async_running, __ATOMIC_SEQ_CST) || This->async_thread_id != GetCurrentThreadId();
+}
+
+/*
+ * Non real-time thread handling the events posted by the JACK callbacks,
+ * so host code behind asioMessage can lock or allocate without stalling JACK
+ */
+static DWORD WINAPI asio_event_thread_function(LPVOID arg)
+{
+    IWineASIOImpl       *This = (IWineASIOImpl*)arg;
+    LONG                events, frames, period;
+    BOOL                replaced;
+    unsigned long long  counted, driver[CounterCount], host[CounterCount];
+    int                 i;
+
+    while (!event_thread_disposed(This))
+    {
+        sem_wait(&This->event_semaphore);
+        if (event_thread_disposed(This))
+            break;
+        events = __atomic_exchange_n(&This->event_pending, 0, __ATOMIC_SEQ_CST);
+        frames = __atomic_load_n(&This->jack_buffersize, __ATOMIC_SEQ_CST);
+
+        /* a new rate on either side only changes the conversion ratio of a resampled host, unless it is out of range now */
+        if (events & (EventJackBufferSize | EventJackSampleRate | EventHostSampleRate))
+        {
+            replaced = FALSE;
+            pthread_mutex_lock(&This->adapter_lock);
+            period = This->period_adapter->jack_buffersize;
+            if ((events & (EventJackSampleRate | EventHostSampleRate)) ? CanSampleRate((LPWINEASIO) This, This->asio_sample_rate) == ASE_OK : frames != period)
+                replaced = period_adapter_replace(This, frames);
+            pthread_mutex_unlock(&This->adapter_lock);
+
+            /* the host keeps running across the change, only a host bound to the JACK period needs new buffers */
+            if (replaced && frames != period)
+            {
+                LOG(LogEvents, LogInfo, "JACK period changed to %i frames, ASIO buffers are %i frames\n", frames, This->asio_current_buffersize);
+                events |= This->wineasio_fixed_buffersize ? EventBufferSizeChange : EventLatenciesChanged;
+            }
+            if (events & (EventJackSampleRate | EventHostSampleRate))
+            {
+                if (replaced)
+                    LOG(LogEvents, LogInfo, "Sample rate changed, JACK runs at %i Hz and the host at %i Hz\n",
+                        This->jack_sample_rate, (int) This->asio_sample_rate);
+                events |= replaced ? EventLatenciesChanged : EventResetRequest;
+            }
+        }
+
+        if (events & EventPerfCounters)
+        {
+            perf_counters_close(This);
+            perf_counters_open(This, This->perf_request_tid);
+        }
+
+        /* the host only takes notifications between Start() and Stop(), and may stop or dispose from within any of them */
+        if (!event_host_ready(This))
+            continue;
+
+        if (events & EventSampleRateChange)
+            This->asio_callbacks->sampleRateDidChange(This->asio_sample_rate);
+
+        if ((events & EventBufferSizeChange) && event_host_ready(This)
+                && !(This->asio_can_buffer_size_change && This->asio_callbacks->asioMessage(kAsioBufferSizeChange, frames, 0, 0)))
+            events |= EventResetRequest;
+
+        /* a reset makes the host query everything again */
+        if (!event_host_ready(This))
+            continue;
+        if ((events & EventResetRequest) && This->asio_can_reset_request)
+            This->asio_callbacks->asioMessage(kAsioResetRequest, 0, 0, 0);
+        else if ((events & EventLatenciesChanged) && This->asio_can_latencies_changed)
+            This->asio_callbacks->asioMessage(kAsioLatenciesChanged, 0, 0, 0);
+
+        if ((events & (EventResync | EventOverload)) && event_host_ready(This))
+        {
+            LOG(LogEvents, LogWarn, "Timing glitch, %i xruns, %i missed deadlines, %i late host callbacks, %i discontinuities\n",
+                 __atomic_load_n(&This->statistics->xruns, __ATOMIC_RELAXED),
+                 __atomic_load_n(&This->statistics->missed_deadlines, __ATOMIC_RELAXED),
+                 __atomic_load_n(&This->statistics->late_callbacks, __ATOMIC_RELAXED),
+                 __atomic_load_n(&This->statistics->discontinuities, __ATOMIC_RELAXED));
+            LOG(LogEvents, LogWarn, "Cycle budget %i us, average/maximum us wake %i/%i, input %i/%i, host %i/%i (cpu %i/%i), output %i/%i\n",
+                 This->statistics->period_budget / 1000,
+                 This->statistics->cost[CostWake].wall_average / 1000, This->statistics->cost[CostWake].wall_maximum / 1000,
+                 This->statistics->cost[CostInput].wall_average / 1000, This->statistics->cost[CostInput].wall_maximum / 1000,
+                 This->statistics->cost[CostHost].wall_average / 1000, This->statistics->cost[CostHost].wall_maximum / 1000,
+                 This->statistics->cost[CostHost].cpu_average / 1000, This->statistics->cost[CostHost].cpu_maximum / 1000,
+                 This->statistics->cost[CostOutput].wall_average / 1000, This->statistics->cost[CostOutput].wall_maximum / 1000);
+            if ((counted = __atomic_load_n(&This->statistics->counted_cycles, __ATOMIC_RELAXED)))
+            {
+                for (i = 0; i < CounterCount; i++)
+                {
+                    driver[i] = __atomic_load_n(&This->statistics->counter_driver[i], __ATOMIC_RELAXED) / counted;
+                    host[i] = __atomic_load_n(&This->statistics->counter_host[i], __ATOMIC_RELAXED) / counted;
+                }
+                LOG(LogEvents, LogWarn, "Per cycle driver/host cycles %llu/%llu, instructions %llu/%llu, cache misses %llu/%llu, minor faults %llu/%llu\n",
+                     driver[CounterCycles], host[CounterCycles], driver[CounterInstructions], host[CounterInstructions],
+                     driver[CounterCacheMisses], host[CounterCacheMisses], driver[CounterMinorFaults], host[CounterMinorFaults]);
+            }
+            if ((events & EventResync) && This->asio_can_resync_request)
+                This->asio_callbacks->asioMessage(kAsioResyncRequest, 0, 0, 0);
+            if ((events & EventOverload) && This->asio_can_overload && event_host_ready(This))
+                This->asio_callbacks->asioMessage(kAsioOverload, 0, 0, 0);
+        }
+    }
+    return 0;
+}
+
+/* set once DisposeBuffers() started, a host that recreated its buffers from within a message already has a new thread */
+static inline BOOL event_thread_disposed(IWineASIOImpl *This)
+{
+    return !__atomic_load_n(&This->event_running, __ATOMIC_SEQ_CST) || This->event_thread_id != GetCurrentThreadId();
+}
+
+/* checked again after every call into the host, which may have stopped or disposed the driver meanwhile */
+static inline BOOL event_host_ready(IWineASIOImpl *This)
+{
+    return !event_thread_disposed(This) && __atomic_load_n(&This->asio_driver_state, __ATOMIC_SEQ_CST) == Running;
+}
+
+/* only ever waited for from another thread, the retired one leaves its loop without touching the semaphore again */
+static void event_thread_join_retired(IWineASIOImpl *This)
+{
+    if (!This->event_thread_retired || This->event_thread_retired_id == GetCurrentThreadId())
+        return;
+    WaitForSingleObject(This->event_thread_retired, INFINITE);
+    CloseHandle(This->event_thread_retired);
+    This->event_thread_retired = NULL;
+    This->event_thread_retired_id = 0;
+}
+
+/*
+ * Called from jack, might be a non wine thread
+ */
+static inline int jack_process_callback(jack_nframes_t nframes, void *arg)
+{
+    ((IWineASIOImpl*)arg)->timing_start = monotonic_ns();
+    trace_event(arg, "cycle", 'B', "nframes", nframes);
+    PROBE(cycle_start, nframes);
+    if (jack_sync_privates.wine_thread == NULL)
+    {
+        // Called from wine thread, just forward the call
+        jack_process_callback_impl(nframes, arg);
+        trace_event(arg, "cycle", 'E', NULL, 0);
+        PROBE(cycle_end, nframes);
+        return 0;
+    }
+    
+    // if (jack_sync_privates.wine_thread_busy == 1)
+    // {
+    //     ERR("Called busy wine thread");
+    //     return 0;
+    // }
+    // non wine thread, needs to delegated it to proper thread
+    jack_sync_privates.jack_pthread = pthread_self();
+    jack_sync_privates.nframes = nframes;
+    jack_sync_privates.arg = arg;
+    // wake up the wine thread to do the actual processing
+    trace_event(arg, "signal", 'i', NULL, 0);
+    PROBE(sync_signal, nframes);
+    sem_post(&jack_sync_privates.wine_semaphore);
+    
+    // wait until the wine thread is done
+    while (sem_wait(&jack_sync_privates.jack_semaphore) && errno == EINTR)
+        ;
+    trace_event(arg, "cycle", 'E', NULL, 0);
+    PROBE(cycle_end, nframes);
+    return 0;
+}
+
+static inline int jack_sample_rate_callback(jack_nframes_t nframes, void *arg)
+{
+    IWineASIOImpl   *This = (IWineASIOImpl*)arg;
+    BOOL            resampling = This->asio_sample_rate != This->jack_sample_rate;
+
+    /* the host keeps its own rate while it is being resampled */
+    This->jack_sample_rate = nframes;
+    if (!resampling)
+        This->asio_sample_rate = nframes;
+    PROBE(sample_rate, nframes, resampling);
+    LOG_RT(LogEvents, LogInfo, "JACK sample rate is now %i Hz\n", nframes);
+
+    /* a resampled host keeps running, only the conversion ratio changes */
+    if (This->event_thread)
+        post_event(This, resampling ? EventJackSampleRate : EventSampleRateChange);
+    return 0;
+}
+
+/*
+ *  Called when the transport starts or is located, JACK may run it on a thread of its own.
+ *  The position goes to the JACK thread with a single store, the driver never holds the transport back.
+ */
+static inline int jack_sync_callback(jack_transport_state_t state, jack_position_t *position, void *arg)
+{
+    IWineASIOImpl       *This = (IWineASIOImpl*)arg;
+    unsigned long long  locate = __atomic_load_n(&This->transport_locate, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&This->transport_locate, ((locate >> 32) + 1) << 32 | position->frame, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ *  Lost cycles also show up as a jump of the JACK timeline, which is where the host is resynced,
+ *  here it is only told that the graph overran
+ */
+static inline int jack_xrun_callback(void *arg)
+{
+    IWineASIOImpl   *This = (IWineASIOImpl*)arg;
+    LONG            delay = jack_get_xrun_delayed_usecs(This->jack_client);
+
+    __atomic_add_fetch(&This->statistics->xruns, 1, __ATOMIC_RELAXED);
+    trace_event(This, "xrun", 'i', "delay_us", delay);
+    LOG_RT(LogAudio, LogInfo, "JACK xrun, delayed by %i us\n", delay);
+    if (This->event_thread)
+        post_event(This, EventOverload);
+    return 0;
+}
+
+/*****************************************************************************
+ *  Support functions
+ */
+
+#ifndef WINE_WITH_UNICODE
+/* Funtion required as unicode.h no longer in WINE */
+static WCHAR *strrchrW(const WCHAR* str, WCHAR ch)
+{
+    WCHAR *ret = NULL;
+    do { if (*str == ch) ret = (WCHAR *)(ULONG_PTR)str; } while (*str++);
+    return ret;
+}
+#endif
+
+/*  
+ *  Function called by JACK on jack_activate to create a thread in the wine process context,
+ *  uses the global structure jack_thread_creator_privates to communicate with jack_thread_creator_helper()
+ */
+static int jack_thread_creator(pthread_t* thread_id, const pthread_attr_t* attr, void *(*function)(void*), void* arg)
+{
+    TRACE("arg: %p, thread_id: %p, attr: %p, function: %p\n", arg, thread_id, attr, function);
+
+    jack_thread_creator_privates.jack_callback_thread = function;
+    jack_thread_creator_privates.arg = arg;
+    jack_thread_creator_privates.jack_callback_thread_created = CreateEventW(NULL, FALSE, FALSE, NULL);
+    CreateThread(NULL, 0, jack_thread_creator_helper, arg, 0, 0); // We jump into jack_thread_creator_helper now
+    // Now we wait until jack_thread_creator_helper is finished and has revealed the thread id
+    WaitForSingleObject(jack_thread_creator_privates.jack_callback_thread_created, INFINITE);
+    // Now we know the thread id an can pass it back to jack
+    *thread_id = jack_thread_creator_privates.jack_callback_pthread_id;
+    return 0;
+}
+
+/*
+ *  internal helper function for returning the posix thread_id of the newly created callback thread
+ *  This basically wraps jack_process_callback, no idea where it's called from yet
+ */
+static DWORD WINAPI jack_thread_creator_helper(LPVOID arg)
+{
+    TRACE("arg: %p\n", arg);
+    // write the id in the shared data
+    jack_thread_creator_privates.jack_callback_pthread_id = pthread_self();
+    // notify the main thread
+    SetEvent(jack_thread_creator_privates.jack_callback_thread_created);
+    // This results in a call to jack_process_callback
+    jack_thread_creator_privates.jack_callback_thread(jack_thread_creator_privates.arg);
+    return 0;
+}
+
+/*
+ *  Lock-free planar audio ring, one producer and one consumer thread.
+ *  The size is rounded up to a power of two so positions can simply wrap.
+ */
+static BOOL audio_ring_alloc(AudioRing *ring, int channels, unsigned int frames)
+{
+    ring->channels = channels;
+    ring->read_pos = ring->write_pos = 0;
+    ring->buffer = NULL;
+    for (ring->size = 1; ring->size < frames; ring->size <<= 1)
+        ;
+
+    if (channels <= 0)
+        return TRUE;
+    ring->buffer = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, channels * ring->size * sizeof(jack_default_audio_sample_t));
+    return ring->buffer != NULL;
+}
+
+static void audio_ring_free(AudioRing *ring)
+{
+    if (ring->buffer)
+        HeapFree(GetProcessHeap(), 0, ring->buffer);
+    ring->buffer = NULL;
+    ring->channels = 0;
+}
+
+/* only valid while neither side is running */
+static void audio_ring_reset(AudioRing *ring)
+{
+    ring->read_pos = ring->write_pos = 0;
+}
+
+static inline unsigned int audio_ring_readable(AudioRing *ring)
+{
+    return __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->read_pos, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int audio_ring_writable(AudioRing *ring)
+{
+    return ring->size - (__atomic_load_n(&ring->write_pos, __ATOMIC_RELAXED) - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE));
+}
+
+/* io applies the gain and meters of a channel on the way, NULL copies as is */
+static inline void audio_ring_read(AudioRing *ring, int channel, jack_default_audio_sample_t *dst, unsigned int frames, IOChannel *io)
+{
+    jack_default_audio_sample_t *lane = ring->buffer + channel * ring->size;
+    unsigned int                start = ring->read_pos & (ring->size - 1);
+    unsigned int                first = ring->size - start < frames ? ring->size - start : frames;
+
+    channel_copy_split(io, dst, lane + start, first, dst + first, lane, frames);
+}
+
+/* a NULL source writes silence */
+static inline void audio_ring_write(AudioRing *ring, int channel, const jack_default_audio_sample_t *src, unsigned int frames, IOChannel *io)
+{
+    jack_default_audio_sample_t *lane = ring->buffer + channel * ring->size;
+    unsigned int                start = ring->write_pos & (ring->size - 1);
+    unsigned int                first = ring->size - start < frames ? ring->size - start : frames;
+
+    if (src)
+    {
+        channel_copy_split(io, lane + start, src, first, lane, src + first, frames);
+    }
+    else
+    {
+        bzero(lane + start, first * sizeof(jack_default_audio_sample_t));
+        bzero(lane, (frames - first) * sizeof(jack_default_audio_sample_t));
+    }
+}
+
+static inline void audio_ring_read_advance(AudioRing *ring, unsigned int frames)
+{
+    __atomic_store_n(&ring->read_pos, ring->read_pos + frames, __ATOMIC_RELEASE);
+}
+
+static inline void audio_ring_write_advance(AudioRing *ring, unsigned int frames)
+{
+    __atomic_store_n(&ring->write_pos, ring->write_pos + frames, __ATOMIC_RELEASE);
+}
+
+/* scale one run of frames by a gain ramp starting at gain, adding to the peak and power of the whole copy */
+static inline void channel_scale(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, unsigned int frames,
+                                 float gain, float step, v4sf *peak, v4sf *power)
+{
+    static const v4si   abs_mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+    v4sf                v, ramp, ramp_step;
+    v4si                larger;
+    float               sample;
+    unsigned int        i;
+
+    ramp = (v4sf) { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    ramp_step = (v4sf) { 4 * step, 4 * step, 4 * step, 4 * step };
+
+    for (i = 0; i + 4 <= frames; i += 4)
+    {
+        memcpy(&v, src + i, sizeof(v));
+        v *= ramp;
+        ramp += ramp_step;
+        memcpy(dst + i, &v, sizeof(v));
+
+        v = (v4sf) ((v4si) v & abs_mask);
+        larger = v > *peak;
+        *peak = (v4sf) ((larger & (v4si) v) | (~larger & (v4si) *peak));
+        *power += v * v;
+    }
+    for (; i < frames; i++)
+    {
+        sample = src[i] * (gain + step * i);
+        dst[i] = sample;
+        (*peak)[0] = fabsf(sample) > (*peak)[0] ? fabsf(sample) : (*peak)[0];
+        (*power)[0] += sample * sample;
+    }
+}
+
+/*
+ *  Copy a channel between JACK and ASIO buffers, ramping from the previous gain to the one
+ *  set by the host and measuring the result for the meters in the same pass.
+ *  Without gain or metering, or without a channel, this is a plain memcpy.
+ */
+static inline void channel_copy(IOChannel *channel, jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, unsigned int frames)
+{
+    channel_copy_split(channel, dst, src, frames, NULL, NULL, frames);
+}
+
+/* the same for a copy wrapping around a ring, the first frames from src to dst and the rest from src2 to dst2,
+ * so the gain ramps and the meters measure across both parts */
+static inline void channel_copy_split(IOChannel *channel, jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src,
+                                      unsigned int first, jack_default_audio_sample_t *dst2, const jack_default_audio_sample_t *src2,
+                                      unsigned int frames)
+{
+    v4sf                peak = { 0, 0, 0, 0 }, power = { 0, 0, 0, 0 };
+    LONG                gain_target, level, rms;
+    float               target, step, sample, peak_max = 0.0f, power_sum;
+    BOOL                metered;
+    unsigned int        i;
+
+    if (!frames)
+        return;
+    if (!channel)
+    {
+        memcpy(dst, src, first * sizeof(jack_default_audio_sample_t));
+        if (frames > first)
+            memcpy(dst2, src2, (frames - first) * sizeof(jack_default_audio_sample_t));
+        return;
+    }
+    gain_target = __atomic_load_n(&channel->gain_target, __ATOMIC_RELAXED);
+    metered = __atomic_load_n(&channel->metered, __ATOMIC_RELAXED);
+    if (gain_target == ASIO_GAIN_UNITY && channel->gain == 1.0f && !metered)
+    {
+        memcpy(dst, src, first * sizeof(jack_default_audio_sample_t));
+        if (frames > first)
+            memcpy(dst2, src2, (frames - first) * sizeof(jack_default_audio_sample_t));
+        return;
+    }
+
+    target = (float) gain_target / ASIO_GAIN_UNITY;
+    step = (target - channel->gain) / frames;
+    channel_scale(dst, src, first, channel->gain, step, &peak, &power);
+    if (frames > first)
+        channel_scale(dst2, src2, frames - first, channel->gain + step * first, step, &peak, &power);
+    channel->gain = target;
+
+    if (!metered)
+        return;
+    for (i = 0; i < 4; i++)
+        if (peak[i] > peak_max)
+            peak_max = peak[i];
+    power_sum = power[0] + power[1] + power[2] + power[3];
+
+    /* full scale is 0x7fffffff, the host resets the peak when it reads it */
+    level = peak_max >= 1.0f ? 0x7fffffff : (LONG) (peak_max * 2147483647.0);
+    if (level > __atomic_load_n(&channel->meter_peak, __ATOMIC_RELAXED))
+        __atomic_store_n(&channel->meter_peak, level, __ATOMIC_RELAXED);
+    sample = sqrtf(power_sum / frames);
+    rms = sample >= 1.0f ? 0x7fffffff : (LONG) (sample * 2147483647.0);
+    __atomic_store_n(&channel->meter_rms, rms, __ATOMIC_RELAXED);
+
+    /* a statistics reader keeps its own peak */
+    if (!channel->shared_meter)
+        return;
+    if (level > __atomic_load_n(&channel->shared_meter->peak, __ATOMIC_RELAXED))
+        __atomic_store_n(&channel->shared_meter->peak, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&channel->shared_meter->rms, rms, __ATOMIC_RELAXED);
+}
+
+/* dst += src * gain */
+static inline void channel_mix(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, unsigned int frames)
+{
+    v4sf                a, b, g = { gain, gain, gain, gain };
+    unsigned int        i;
+
+    for (i = 0; i + 4 <= frames; i += 4)
+    {
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a += b * g;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < frames; i++)
+        dst[i] += src[i] * gain;
+}
+
+static IOChannel *channel_from_controls(IWineASIOImpl *This, ASIOChannelControls *controls, BOOL input)
+{
+    if (!controls || controls->channel < 0 || !This->input_channel)
+        return NULL;
+    if (input)
+        return controls->channel < This->wineasio_number_inputs + This->wineasio_number_loopbacks ? &This->input_channel[controls->channel] : NULL;
+    return controls->channel < This->wineasio_number_outputs ? &This->output_channel[controls->channel] : NULL;
+}
+
+/* zeroth order modified Bessel function of the first kind, for the Kaiser window */
+static double bessel_i0(double x)
+{
+    double  sum = 1.0, term = 1.0;
+    int     k;
+
+    for (k = 1; k < 32; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static inline float dot_product(const jack_default_audio_sample_t *a, const float *b, int n)
+{
+    v4sf    acc = { 0, 0, 0, 0 }, va, vb;
+    int     i;
+
+    for (i = 0; i < n; i += 4)
+    {
+        memcpy(&va, a + i, sizeof(va));
+        memcpy(&vb, b + i, sizeof(vb));
+        acc += va * vb;
+    }
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+/*
+ *  step is the number of input frames per output frame, max_input the most frames appended at once.
+ *  The kernel is a Kaiser windowed sinc with the cutoff below the lower of both Nyquist frequencies,
+ *  tabulated at RESAMPLER_PHASES + 1 fractional offsets and linearly interpolated in between.
+ */
+static BOOL resampler_init(Resampler *rs, int channels, double step, unsigned int max_input)
+{
+    double  cutoff = 0.92 * (step > 1.0 ? 1.0 / step : 1.0);
+    double  t, x, w;
+    int     p, k;
+
+    rs->channels = channels;
+    rs->step = step;
+    rs->capacity = RESAMPLER_TAPS + max_input + (unsigned int) step + 2;
+    rs->history = NULL;
+    rs->kernel = HeapAlloc(GetProcessHeap(), 0, (RESAMPLER_PHASES + 1) * RESAMPLER_TAPS * sizeof(float));
+    if (!rs->kernel)
+        return FALSE;
+
+    for (p = 0; p <= RESAMPLER_PHASES; p++)
+        for (k = 0; k < RESAMPLER_TAPS; k++)
+        {
+            t = k - RESAMPLER_TAPS / 2 + 1 - (double) p / RESAMPLER_PHASES;
+            x = t / (RESAMPLER_TAPS / 2);
+            w = x * x < 1.0 ? bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1.0 - x * x)) / bessel_i0(RESAMPLER_KAISER_BETA) : 0.0;
+            rs->kernel[p * RESAMPLER_TAPS + k] = cutoff * w * (t == 0.0 ? 1.0 : sin(M_PI * cutoff * t) / (M_PI * cutoff * t));
+        }
+
+    if (channels > 0)
+    {
+        rs->history = HeapAlloc(GetProcessHeap(), 0, channels * rs->capacity * sizeof(jack_default_audio_sample_t));
+        if (!rs->history)
+            return FALSE;
+    }
+    resampler_reset(rs);
+    return TRUE;
+}
+
+static void resampler_free(Resampler *rs)
+{
+    if (rs->history)
+        HeapFree(GetProcessHeap(), 0, rs->history);
+    if (rs->kernel)
+        HeapFree(GetProcessHeap(), 0, rs->kernel);
+    rs->history = NULL;
+    rs->kernel = NULL;
+}
+
+/* silence ahead of the first input so the kernel of the first output is centered on it */
+static void resampler_reset(Resampler *rs)
+{
+    int i;
+
+    rs->position = 0.0;
+    rs->fill = RESAMPLER_TAPS / 2 - 1;
+    for (i = 0; i < rs->channels; i++)
+        bzero(rs->history + i * rs->capacity, rs->fill * sizeof(jack_default_audio_sample_t));
+}
+
+/* input frames still missing before outputs frames can be produced */
+static inline unsigned int resampler_input_needed(Resampler *rs, unsigned int outputs)
+{
+    unsigned int last = (unsigned int) (rs->position + (outputs - 1) * rs->step) + RESAMPLER_TAPS;
+
+    return last > rs->fill ? last - rs->fill : 0;
+}
+
+static inline unsigned int resampler_outputs_available(Resampler *rs)
+{
+    unsigned int    outputs;
+
+    if (rs->fill < RESAMPLER_TAPS + (unsigned int) rs->position)
+        return 0;
+    outputs = (unsigned int) ceil((rs->fill - RESAMPLER_TAPS + 1 - rs->position) / rs->step);
+    while (outputs && (unsigned int) (rs->position + (outputs - 1) * rs->step) + RESAMPLER_TAPS > rs->fill)
+        outputs--;
+    return outputs;
+}
+
+/* where the next input frames of a channel go */
+static inline jack_default_audio_sample_t *resampler_input(Resampler *rs, int channel)
+{
+    return rs->history + channel * rs->capacity + rs->fill;
+}
+
+static inline void resampler_input_advance(Resampler *rs, unsigned int frames)
+{
+    rs->fill += frames;
+}
+
+static inline void resampler_run(Resampler *rs, int channel, jack_default_audio_sample_t *out, unsigned int outputs)
+{
+    jack_default_audio_sample_t *lane = rs->history + channel * rs->capacity;
+    double                      position = rs->position;
+    float                       phase, fraction, a, b;
+    unsigned int                i, index, row;
+
+    for (i = 0; i < outputs; i++, position += rs->step)
+    {
+        index = (unsigned int) position;
+        phase = (position - index) * RESAMPLER_PHASES;
+        row = (unsigned int) phase;
+        fraction = phase - row;
+        a = dot_product(lane + index, rs->kernel + row * RESAMPLER_TAPS, RESAMPLER_TAPS);
+        b = dot_product(lane + index, rs->kernel + (row + 1) * RESAMPLER_TAPS, RESAMPLER_TAPS);
+        out[i] = a + (b - a) * fraction;
+    }
+}
+
+/* move past the produced frames and drop the history no later output can reach */
+static inline void resampler_advance(Resampler *rs, unsigned int outputs)
+{
+    unsigned int    consumed;
+    int             i;
+
+    rs->position += outputs * rs->step;
+    consumed = (unsigned int) rs->position;
+    if (consumed > rs->fill)
+        consumed = rs->fill;
+    if (!consumed)
+        return;
+
+    for (i = 0; i < rs->channels; i++)
+        memmove(rs->history + i * rs->capacity, rs->history + i * rs->capacity + consumed,
+                (rs->fill - consumed) * sizeof(jack_default_audio_sample_t));
+    rs->fill -= consumed;
+    rs->position -= consumed;
+}
+
+/*
+ *  Pick how ASIO buffers are fed from JACK periods of a given size.
+ *  When the JACK period is a whole multiple of the ASIO buffer it is processed in slices
+ *  without added latency, anything else goes through a pair of rings.
+ */
+static PeriodAdapter *period_adapter_create(IWineASIOImpl *This, LONG jack_buffersize, LONG asio_buffersize)
+{
+    PeriodAdapter   *adapter;
+    LONG            a, b, t, period, headroom;
+    double          ratio = This->asio_sample_rate / This->jack_sample_rate;
+
+    adapter = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*adapter));
+    if (!adapter)
+        return NULL;
+
+    adapter->jack_buffersize = jack_buffersize;
+    adapter->asio_buffersize = asio_buffersize;
+
+    if (jack_buffersize % asio_buffersize == 0 && This->wineasio_async_periods <= 0 && ratio == 1.0)
+    {
+        adapter->mode = AdapterSlice;
+        adapter->slices = jack_buffersize / asio_buffersize;
+        if (adapter->slices > 1)
+            TRACE("JACK periods of %i frames split into %i ASIO buffers\n", jack_buffersize, adapter->slices);
+        return adapter;
+    }
+
+    /* A JACK period pulls from the output ring before the ASIO buffer that covers it is complete.
+     * The worst shortfall is the ASIO buffer size minus the gcd of both sizes, prime the ring with that. */
+    for (a = asio_buffersize, b = jack_buffersize; b; a = b, b = t)
+        t = a % b;
+    adapter->mode = AdapterRing;
+    adapter->input_latency = asio_buffersize - a;
+    period = jack_buffersize;
+
+    /* Resampled periods vary in length by a frame and the output side reads a whole kernel ahead,
+     * on top of that each kernel delays its signal by half its length */
+    if (ratio != 1.0)
+    {
+        adapter->resampling = TRUE;
+        period = (LONG) ceil(jack_buffersize * ratio);
+        adapter->input_latency = asio_buffersize + period + RESAMPLER_TAPS + (LONG) ceil(RESAMPLER_TAPS / 2 * (ratio > 1.0 ? ratio : 1.0));
+
+        adapter->resampler_scratch_frames = period + 2;
+        adapter->resampler_scratch = HeapAlloc(GetProcessHeap(), 0, adapter->resampler_scratch_frames * sizeof(jack_default_audio_sample_t));
+        if (!adapter->resampler_scratch
+                || !resampler_init(&adapter->input_resampler, This->wineasio_number_inputs, 1.0 / ratio, jack_buffersize)
+                || !resampler_init(&adapter->output_resampler, This->wineasio_number_outputs, ratio, period + 2))
+        {
+            period_adapter_destroy(adapter);
+            return NULL;
+        }
+    }
+
+    /* A host on its own thread only has the output of a JACK period ready in a later one,
+     * so every period of headroom given to it adds a JACK period of latency on the way out.
+     * An ASIO buffer longer than the period gets as many periods as it spans, it never runs within one JACK cycle. */
+    adapter->output_latency = adapter->input_latency;
+    if (This->wineasio_async_periods > 0 || asio_buffersize > period)
+    {
+        adapter->threaded = TRUE;
+        headroom = (asio_buffersize + period - 1) / period;
+        if (headroom < This->wineasio_async_periods)
+            headroom = This->wineasio_async_periods;
+        adapter->output_latency += headroom * period;
+    }
+
+    if (!audio_ring_alloc(&adapter->input_ring, This->wineasio_number_inputs, 2 * (period + asio_buffersize) + adapter->input_latency)
+            || !audio_ring_alloc(&adapter->output_ring, This->wineasio_number_outputs, 2 * (period + asio_buffersize) + adapter->output_latency))
+    {
+        period_adapter_destroy(adapter);
+        return NULL;
+    }
+    TRACE("ASIO buffers of %i frames bridged to JACK periods of %i frames, %i/%i frames added input/output latency\n",
+          asio_buffersize, jack_buffersize, adapter->input_latency, adapter->output_latency);
+    return adapter;
+}
+
+static void period_adapter_destroy(PeriodAdapter *adapter)
+{
+    if (!adapter)
+        return;
+    audio_ring_free(&adapter->input_ring);
+    audio_ring_free(&adapter->output_ring);
+    resampler_free(&adapter->input_resampler);
+    resampler_free(&adapter->output_resampler);
+    if (adapter->resampler_scratch)
+        HeapFree(GetProcessHeap(), 0, adapter->resampler_scratch);
+    HeapFree(GetProcessHeap(), 0, adapter);
+}
+
+/* empty both rings and prime the output with the adapter latency worth of silence */
+static void period_adapter_reset(PeriodAdapter *adapter)
+{
+    int i;
+
+    if (!adapter || adapter->mode != AdapterRing)
+        return;
+
+    audio_ring_reset(&adapter->input_ring);
+    audio_ring_reset(&adapter->output_ring);
+    if (adapter->resampling)
+    {
+        resampler_reset(&adapter->input_resampler);
+        resampler_reset(&adapter->output_resampler);
+    }
+    for (i = 0; i < adapter->output_ring.channels; i++)
+        audio_ring_write(&adapter->output_ring, i, NULL, adapter->output_latency, NULL);
+    audio_ring_write_advance(&adapter->output_ring, adapter->output_latency);
+}
+
+/*
+ *  Build an adapter for the current ASIO buffers and a JACK period off the real-time thread,
+ *  and wait for the JACK thread to take it over at the start of a cycle. The caller holds adapter_lock.
+ */
+static BOOL period_adapter_replace(IWineASIOImpl *This, LONG jack_buffersize)
+{
+    PeriodAdapter   *adapter, *retired;
+    int             i;
+
+    adapter = period_adapter_create(This, jack_buffersize, This->asio_current_buffersize);
+    if (!adapter)
+    {
+        ERR("Unable to allocate the period adapter for %i/%i frames\n", jack_buffersize, This->asio_current_buffersize);
+        return FALSE;
+    }
+    period_adapter_reset(adapter);
+
+    __atomic_store_n(&This->pending_adapter, adapter, __ATOMIC_SEQ_CST);
+    for (i = 0; i < 1000 && __atomic_load_n(&This->pending_adapter, __ATOMIC_SEQ_CST); i++)
+        Sleep(1);
+
+    /* JACK did not run a cycle within a second, take it back */
+    if (__atomic_exchange_n(&This->pending_adapter, NULL, __ATOMIC_SEQ_CST))
+    {
+        WARN("JACK did not pick up the new period adapter\n");
+        period_adapter_destroy(adapter);
+        return FALSE;
+    }
+
+    /* the JACK thread hands back the old one right after taking the new one */
+    while (!(retired = __atomic_exchange_n(&This->retired_adapter, NULL, __ATOMIC_SEQ_CST)))
+        Sleep(0);
+
+    /* the asynchronous thread may still be working on it */
+    while (__atomic_load_n(&This->async_busy, __ATOMIC_SEQ_CST))
+        Sleep(1);
+    period_adapter_destroy(retired);
+
+    if (period_adapter_publish_latency(This, adapter))
+        jack_recompute_total_latencies(This->jack_client);
+    return TRUE;
+}
+
+/* the latency callback and GetLatencies() only ever read the frames stored here, never the adapter itself */
+static BOOL period_adapter_publish_latency(IWineASIOImpl *This, PeriodAdapter *adapter)
+{
+    double          ratio = This->jack_sample_rate / This->asio_sample_rate;
+    jack_nframes_t  input = (jack_nframes_t) ceil(adapter->input_latency * ratio);
+    jack_nframes_t  output = (jack_nframes_t) ceil(adapter->output_latency * ratio);
+    BOOL            changed;
+
+    changed = __atomic_exchange_n(&This->adapter_input_latency, input, __ATOMIC_SEQ_CST) != input;
+    changed |= __atomic_exchange_n(&This->adapter_output_latency, output, __ATOMIC_SEQ_CST) != output;
+    return changed;
+}
+
+/* only ever one writer, for the sample position the thread running the host, or Start() before there is one */
+static inline void snapshot_publish(PositionSnapshot *snapshot, unsigned long long position, unsigned long long system_time)
+{
+    LONG            sequence = snapshot->sequence;
+
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&snapshot->position, position, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->system_time, system_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* retry while the writer is in the middle of a new pair, which takes a few stores */
+static inline void snapshot_read(PositionSnapshot *snapshot, unsigned long long *position, unsigned long long *system_time)
+{
+    LONG            sequence;
+
+    do
+    {
+        sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+        *position = __atomic_load_n(&snapshot->position, __ATOMIC_RELAXED);
+        *system_time = __atomic_load_n(&snapshot->system_time, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED));
+}
+
+static inline void post_event(IWineASIOImpl *This, LONG event)
+{
+    __atomic_fetch_or(&This->event_pending, event, __ATOMIC_SEQ_CST);
+    sem_post(&This->event_semaphore);
+}
+
+/* a channel or port number, or a range of them like 3-8, counted from 1 */
+static BOOL routing_parse_range(const char **spec, long *first, long *last)
+{
+    char    *end;
+
+    *first = *last = strtol(*spec, &end, 10);
+    if (end == *spec || *first < 1)
+        return FALSE;
+    if (*end == '-')
+    {
+        *spec = end + 1;
+        *last = strtol(*spec, &end, 10);
+        if (end == *spec || *last < *first)
+            return FALSE;
+    }
+    *spec = end;
+    return TRUE;
+}
+
+/* Parse routes of the form from>to[@gain_db], separated by commas or spaces, and register the ports they name.
+ * The ASIO channel is on the left for outputs and on the right for inputs, when the two ranges differ
+ * in length the shorter one is cycled, so 1-32>1-2 sums odd channels to port 1 and even ones to port 2.
+ * No valid route leaves *created NULL, only running out of memory or ports fails. */
+static BOOL routing_create(IWineASIOImpl *This, const char *spec, BOOL input, Routing **created)
+{
+    Routing         *routing;
+    RoutingEntry    *entries = NULL, *grown;
+    const char      *token;
+    char            *end;
+    char            port_name[ASIO_MAX_NAME_LENGTH];
+    long            first[2], last[2], length[2], channel, port;
+    double          gain_db;
+    int             port_index[ROUTING_MAXIMUM_PORTS];
+    int             channels, num_entries = 0, capacity = 0, num_ports = 0, i, k, count;
+    BOOL            valid;
+
+    *created = NULL;
+    for (i = 0; i < ROUTING_MAXIMUM_PORTS; i++)
+        port_index[i] = -1;
+    channels = input ? This->wineasio_number_inputs : This->wineasio_number_outputs;
+    while (*spec)
+    {
+        if (*spec == ',' || *spec == ' ' || *spec == '\t')
+        {
+            spec++;
+            continue;
+        }
+
+        token = spec;
+        gain_db = 0.0;
+        valid = routing_parse_range(&spec, &first[0], &last[0]) && *spec++ == '>'
+                && routing_parse_range(&spec, &first[1], &last[1]);
+        if (valid && *spec == '@')
+        {
+            gain_db = strtod(spec + 1, &end);
+            valid = end != spec + 1;
+            spec = end;
+        }
+        if (!valid || (*spec && *spec != ',' && *spec != ' ' && *spec != '\t'))
+        {
+            while (*spec && *spec != ',' && *spec != ' ' && *spec != '\t')
+                spec++;
+            WARN("Ignoring malformed route '%.*s'\n", (int) (spec - token), token);
+            continue;
+        }
+
+        length[0] = last[0] - first[0] + 1;
+        length[1] = last[1] - first[1] + 1;
+        count = length[0] > length[1] ? length[0] : length[1];
+        for (k = 0; k < count; k++)
+        {
+            channel = input ? first[1] + k % length[1] : first[0] + k % length[0];
+            port = input ? first[0] + k % length[0] : first[1] + k % length[1];
+            if (channel > channels || port > ROUTING_MAXIMUM_PORTS)
+            {
+                WARN("Ignoring route between channel %li and port %li, out of range\n", channel, port);
+                continue;
+            }
+
+            if (num_entries == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 16;
+                grown = entries ? HeapReAlloc(GetProcessHeap(), 0, entries, capacity * sizeof(RoutingEntry))
+                                : HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(RoutingEntry));
+                if (!grown)
+                {
+                    ERR("Unable to allocate the routing matrix\n");
+                    if (entries)
+                        HeapFree(GetProcessHeap(), 0, entries);
+                    return FALSE;
+                }
+                entries = grown;
+            }
+            entries[num_entries].channel = channel - 1;
+            entries[num_entries].port = port - 1;
+            entries[num_entries].gain = powf(10.0f, gain_db / 20.0f);
+            num_entries++;
+            port_index[port - 1] = 0;
+        }
+    }
+
+    if (!num_entries)
+        return TRUE;
+
+    /* ports are numbered as named but only the used ones exist, in ascending order */
+    for (i = 0; i < ROUTING_MAXIMUM_PORTS; i++)
+        if (!port_index[i])
+            port_index[i] = num_ports++;
+    for (k = 0; k < num_entries; k++)
+        entries[k].port = port_index[entries[k].port];
+
+    routing = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Routing));
+    if (routing)
+    {
+        routing->ports = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, num_ports * sizeof(jack_port_t *));
+        routing->port_numbers = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, num_ports * sizeof(int));
+        routing->port_buffers = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, num_ports * sizeof(jack_default_audio_sample_t *));
+        routing->scratch = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, channels * ASIO_MAXIMUM_BUFFERSIZE * sizeof(jack_default_audio_sample_t));
+    }
+    if (!routing || !routing->ports || !routing->port_numbers || !routing->port_buffers || !routing->scratch)
+    {
+        ERR("Unable to allocate the routing matrix\n");
+        HeapFree(GetProcessHeap(), 0, entries);
+        routing_destroy(This, routing);
+        return FALSE;
+    }
+    routing->entries = entries;
+    routing->num_entries = num_entries;
+    routing->num_ports = num_ports;
+
+    for (i = 0; i < ROUTING_MAXIMUM_PORTS; i++)
+    {
+        if (port_index[i] < 0)
+            continue;
+        k = port_index[i];
+        routing->port_numbers[k] = i + 1;
+        snprintf(port_name, ASIO_MAX_NAME_LENGTH, input ? "in_%i" : "out_%i", i + 1);
+        routing->ports[k] = jack_port_register(This->jack_client, port_name, JACK_DEFAULT_AUDIO_TYPE,
+                                               input ? JackPortIsInput : JackPortIsOutput, i);
+        if (!routing->ports[k])
+        {
+            ERR("Unable to register the JACK port %s\n", port_name);
+            routing_destroy(This, routing);
+            return FALSE;
+        }
+    }
+
+    TRACE("%s routing of %i entries between %i ASIO channels and %i JACK ports\n",
+          input ? "Input" : "Output", num_entries, channels, num_ports);
+    *created = routing;
+    return TRUE;
+}
+
+static void routing_destroy(IWineASIOImpl *This, Routing *routing)
+{
+    int i;
+
+    if (!routing)
+        return;
+    for (i = 0; i < routing->num_ports; i++)
+        if (routing->ports[i])
+            jack_port_unregister(This->jack_client, routing->ports[i]);
+    if (routing->ports)
+        HeapFree(GetProcessHeap(), 0, routing->ports);
+    if (routing->port_numbers)
+        HeapFree(GetProcessHeap(), 0, routing->port_numbers);
+    if (routing->port_buffers)
+        HeapFree(GetProcessHeap(), 0, routing->port_buffers);
+    if (routing->entries)
+        HeapFree(GetProcessHeap(), 0, routing->entries);
+    if (routing->scratch)
+        HeapFree(GetProcessHeap(), 0, routing->scratch);
+    HeapFree(GetProcessHeap(), 0, routing);
+}
+
+/*
+ *  Map the statistics block of this instance, falling back to the heap so the driver keeps
+ *  its accounting when /dev/shm is not available
+ */
+static BOOL shared_statistics_create(IWineASIOImpl *This)
+{
+    SharedStatistics    *shared = MAP_FAILED;
+    int                 channels = This->wineasio_number_inputs + This->wineasio_number_loopbacks + This->wineasio_number_outputs;
+    size_t              size = sizeof(SharedStatistics) + channels * sizeof(SharedMeter);
+    char                *c;
+    int                 fd, i, error = 0;
+
+    snprintf(This->shared_path, sizeof(This->shared_path), SHARED_STATISTICS_PATH, (int) getpid(), jack_get_client_name(This->jack_client));
+    for (c = This->shared_path + strlen("/dev/shm/"); *c; c++)
+        if (*c == '/' || *c == ' ')
+            *c = '_';
+
+    /* the reason is kept before close() can overwrite errno */
+    if ((fd = open(This->shared_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0)
+    {
+        if (ftruncate(fd, size) || (shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+            error = errno;
+        close(fd);
+    }
+    else
+        error = errno;
+    if (shared == MAP_FAILED)
+    {
+        LOG(LogDiagnostics, LogWarn, "Unable to publish statistics in %s: %s\n", This->shared_path, strerror(error));
+        if (fd >= 0)
+            unlink(This->shared_path);
+        This->shared_path[0] = 0;
+        if (!(shared = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size)))
+            return FALSE;
+    }
+
+    shared->version = SHARED_STATISTICS_VERSION;
+    shared->size = size;
+    shared->statistics_offset = offsetof(SharedStatistics, statistics);
+    shared->meter_offset = offsetof(SharedStatistics, meter);
+    shared->pid = getpid();
+    strncpy(shared->client_name, jack_get_client_name(This->jack_client), ASIO_MAX_NAME_LENGTH - 1);
+    shared->num_inputs = This->wineasio_number_inputs + This->wineasio_number_loopbacks;
+    shared->num_outputs = This->wineasio_number_outputs;
+
+    This->shared = shared;
+    This->shared_size = size;
+    This->shared_metering = FALSE;
+    This->statistics = &shared->statistics;
+    for (i = 0; i < channels; i++)
+        This->input_channel[i].shared_meter = &shared->meter[i];
+
+    /* readers ignore the block until the magic shows up */
+    __atomic_store_n(&shared->magic, SHARED_STATISTICS_MAGIC, __ATOMIC_RELEASE);
+    TRACE("Statistics published in %s\n", This->shared_path[0] ? This->shared_path : "process memory");
+    return TRUE;
+}
+
+static void shared_statistics_destroy(IWineASIOImpl *This)
+{
+    if (!This->shared)
+        return;
+    if (This->shared_path[0])
+    {
+        munmap(This->shared, This->shared_size);
+        unlink(This->shared_path);
+        This->shared_path[0] = 0;
+    }
+    else
+        HeapFree(GetProcessHeap(), 0, This->shared);
+    This->shared = NULL;
+    This->statistics = NULL;
+}
+
+/*
+ *  Driver state and configuration, updated by the thread that changes them
+ */
+static void shared_statistics_publish(IWineASIOImpl *This)
+{
+    SharedStatistics    *shared = This->shared;
+    int                 i;
+
+    __atomic_store_n(&shared->state, This->asio_driver_state, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->asio_buffersize, This->asio_current_buffersize, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->active_inputs, This->asio_active_inputs, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->active_outputs, This->asio_active_outputs, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->jack_buffersize, This->jack_buffersize, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->asio_sample_rate, (LONG) This->asio_sample_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->jack_sample_rate, This->jack_sample_rate, __ATOMIC_RELAXED);
+    for (i = 0; i < shared->num_inputs + shared->num_outputs; i++)
+        __atomic_store_n(&shared->meter[i].active, This->input_channel[i].active, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Everything that changes while running, once per JACK cycle from the processing thread
+ */
+static inline void shared_statistics_cycle(IWineASIOImpl *This)
+{
+    SharedStatistics    *shared = This->shared;
+    int                 i;
+
+    __atomic_store_n(&shared->jack_buffersize, This->jack_buffersize, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->asio_sample_rate, (LONG) This->asio_sample_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->jack_sample_rate, This->jack_sample_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->sample_position,
+                     ((unsigned long long) This->asio_sample_position.hi << 32) | This->asio_sample_position.lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->cycles, shared->cycles + 1, __ATOMIC_RELAXED);
+
+    /* once a reader asks for meters the channels stay metered, like they do for the host */
+    if (!This->shared_metering && __atomic_load_n(&shared->metering, __ATOMIC_RELAXED))
+    {
+        for (i = 0; i < shared->num_inputs + shared->num_outputs; i++)
+            __atomic_store_n(&This->input_channel[i].metered, TRUE, __ATOMIC_RELAXED);
+        This->shared_metering = TRUE;
+    }
+}
+
+/* rings are looked up per thread, the generation tells apart a trace that replaced an earlier one */
+static LONG                 trace_generation;
+static __thread LONG        trace_thread_generation;
+static __thread TraceRing   *trace_thread_ring;
+
+/*
+ *  Open the trace file and start the thread that writes the rings out, without a trace file
+ *  or on any error the driver runs untraced
+ */
+static void trace_create(IWineASIOImpl *This)
+{
+    Trace   *trace;
+
+    if (!This->wineasio_trace_file[0])
+        return;
+    if (!(trace = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Trace))))
+    {
+        LOG(LogDiagnostics, LogWarn, "Unable to allocate the trace rings\n");
+        return;
+    }
+    if (!(trace->file = fopen(This->wineasio_trace_file, "w")))
+    {
+        LOG(LogDiagnostics, LogWarn, "Unable to open trace file %s: %s\n", This->wineasio_trace_file, strerror(errno));
+        HeapFree(GetProcessHeap(), 0, trace);
+        return;
+    }
+
+    /* the JSON array format, the closing bracket is optional so a trace cut short still loads */
+    fprintf(trace->file, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,\"args\":{\"name\":\"WineASIO %s\"}}",
+            (int) getpid(), jack_get_client_name(This->jack_client));
+    trace->generation = __atomic_add_fetch(&trace_generation, 1, __ATOMIC_SEQ_CST);
+    trace->running = TRUE;
+    This->trace = trace;
+    if (!(trace->thread = CreateThread(NULL, 0, trace_flush_thread_function, This, 0, NULL)))
+    {
+        LOG(LogDiagnostics, LogWarn, "Unable to create the trace thread\n");
+        This->trace = NULL;
+        fclose(trace->file);
+        HeapFree(GetProcessHeap(), 0, trace);
+        return;
+    }
+    TRACE("Tracing to %s\n", This->wineasio_trace_file);
+}
+
+/* only once JACK and the host no longer call into the driver */
+static void trace_destroy(IWineASIOImpl *This)
+{
+    Trace   *trace = This->trace;
+    int     i;
+
+    if (!trace)
+        return;
+    __atomic_store_n(&trace->running, FALSE, __ATOMIC_SEQ_CST);
+    WaitForSingleObject(trace->thread, INFINITE);
+    CloseHandle(trace->thread);
+    This->trace = NULL;
+
+    fprintf(trace->file, "\n]\n");
+    fclose(trace->file);
+    for (i = 0; i < TRACE_THREADS; i++)
+        if (trace->rings[i].dropped)
+        {
+            LOG(LogDiagnostics, LogWarn, "Trace dropped %i events of thread %i\n", trace->rings[i].dropped, trace->rings[i].tid);
+        }
+    HeapFree(GetProcessHeap(), 0, trace);
+}
+
+/*
+ *  Wait-free, called from any thread including the real-time ones. Events of a thread beyond
+ *  TRACE_THREADS or of a full ring are dropped.
+ */
+static inline void trace_event(IWineASIOImpl *This, const char *name, char phase, const char *arg_name, LONG arg)
+{
+    Trace           *trace = This->trace;
+    TraceRing       *ring;
+    TraceEvent      *event;
+    unsigned int    pos;
+    LONG            index;
+
+    if (!trace)
+        return;
+    if (trace_thread_generation != trace->generation)
+    {
+        trace_thread_generation = trace->generation;
+        trace_thread_ring = NULL;
+        index = __atomic_fetch_add(&trace->num_rings, 1, __ATOMIC_SEQ_CST);
+        if (index < TRACE_THREADS)
+        {
+            trace_thread_ring = &trace->rings[index];
+            trace_thread_ring->tid = syscall(SYS_gettid);
+            __atomic_store_n(&trace_thread_ring->claimed, TRUE, __ATOMIC_RELEASE);
+        }
+    }
+    if (!(ring = trace_thread_ring))
+        return;
+
+    pos = ring->write_pos;
+    if (pos - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    event = &ring->events[pos & (TRACE_RING_EVENTS - 1)];
+    event->time = monotonic_ns();
+    event->name = name;
+    event->phase = phase;
+    event->arg_name = arg_name;
+    event->arg = arg;
+    __atomic_store_n(&ring->write_pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_flush(Trace *trace)
+{
+    TraceRing       *ring;
+    TraceEvent      *event;
+    unsigned int    pos, end;
+    char            path[64], comm[32];
+    FILE            *file;
+    int             i, pid = getpid();
+
+    for (i = 0; i < TRACE_THREADS; i++)
+    {
+        ring = &trace->rings[i];
+        if (!__atomic_load_n(&ring->claimed, __ATOMIC_ACQUIRE))
+            continue;
+
+        /* name the thread after what the kernel calls it, so it matches other traces */
+        if (!ring->named)
+        {
+            snprintf(path, sizeof(path), "/proc/self/task/%i/comm", ring->tid);
+            comm[0] = 0;
+            if ((file = fopen(path, "r")))
+            {
+                if (!fgets(comm, sizeof(comm), file))
+                    comm[0] = 0;
+                fclose(file);
+            }
+            comm[strcspn(comm, "\n\"\\")] = 0;
+            fprintf(trace->file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":\"%s\"}}",
+                    pid, ring->tid, comm[0] ? comm : "unknown");
+            ring->named = TRUE;
+        }
+
+        end = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+        for (pos = ring->read_pos; pos != end; pos++)
+        {
+            event = &ring->events[pos & (TRACE_RING_EVENTS - 1)];
+            fprintf(trace->file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%llu.%03u,\"pid\":%i,\"tid\":%i",
+                    event->name, event->phase, event->phase == 'i' ? "\"s\":\"t\"," : "",
+                    event->time / 1000, (unsigned int) (event->time % 1000), pid, ring->tid);
+            if (event->arg_name)
+                fprintf(trace->file, ",\"args\":{\"%s\":%i}}", event->arg_name, event->arg);
+            else
+                fprintf(trace->file, "}");
+        }
+        __atomic_store_n(&ring->read_pos, end, __ATOMIC_RELEASE);
+    }
+    fflush(trace->file);
+}
+
+/*
+ *  Writes the rings out every TRACE_FLUSH_INTERVAL milliseconds, and a last time when the trace ends
+ */
+static DWORD WINAPI trace_flush_thread_function(LPVOID arg)
+{
+    IWineASIOImpl   *This = (IWineASIOImpl*)arg;
+    Trace           *trace = This->trace;
+
+    while (__atomic_load_n(&trace->running, __ATOMIC_SEQ_CST))
+    {
+        Sleep(TRACE_FLUSH_INTERVAL);
+        trace_flush(trace);
+    }
+    trace_flush(trace);
+    return 0;
+}
+
+/* per thread, NULL until the thread logs from real-time context the first time */
+static __thread LogRing     *log_thread_ring;
+
+static const char * const   log_level_names[] = { "none", "error", "warn", "info", "debug" };
+static const char * const   log_category_names[] = { "driver", "audio", "events", "diagnostics" };
+
+/*
+ *  Set the levels from a list separated by commas or spaces, a level alone applies to every category,
+ *  category=level to that one only, later entries win. Unset categories stay at warn.
+ */
+static void log_configure(const char *spec)
+{
+    const char  *token, *level_name;
+    size_t      length, name_length;
+    int         category, level;
+
+    for (category = 0; category < LogCategoryCount; category++)
+        __atomic_store_n(&logger.levels[category], LogWarn, __ATOMIC_RELAXED);
+
+    while (*(spec += strspn(spec, ", ")))
+    {
+        token = spec;
+        length = strcspn(spec, ", ");
+        spec += length;
+
+        category = -1;
+        level_name = token;
+        name_length = length;
+        if (memchr(token, '=', length))
+        {
+            name_length = strchr(token, '=') - token;
+            for (category = 0; category < LogCategoryCount; category++)
+                if (strlen(log_category_names[category]) == name_length && !strncasecmp(token, log_category_names[category], name_length))
+                    break;
+            level_name = token + name_length + 1;
+            name_length = length - name_length - 1;
+        }
+        for (level = LogNone; level <= LogDebug; level++)
+            if (strlen(log_level_names[level]) == name_length && !strncasecmp(level_name, log_level_names[level], name_length))
+                break;
+        if (category == LogCategoryCount || level > LogDebug)
+        {
+            WARN("Ignoring malformed log level '%.*s'\n", (int) length, token);
+            continue;
+        }
+
+        if (category >= 0)
+            __atomic_store_n(&logger.levels[category], level, __ATOMIC_RELAXED);
+        else
+            for (category = 0; category < LogCategoryCount; category++)
+                __atomic_store_n(&logger.levels[category], level, __ATOMIC_RELAXED);
+    }
+}
+
+/* the first initialized driver starts the log thread, the last one stops it */
+static void log_start(void)
+{
+    if (InterlockedIncrement(&logger.users) > 1)
+        return;
+    if (!logger.semaphore_ready)
+    {
+        sem_init(&logger.semaphore, 0, 0);
+        logger.semaphore_ready = TRUE;
+    }
+    __atomic_store_n(&logger.running, TRUE, __ATOMIC_SEQ_CST);
+    if (!(logger.thread = CreateThread(NULL, 0, log_thread_function, NULL, 0, NULL)))
+    {
+        __atomic_store_n(&logger.running, FALSE, __ATOMIC_SEQ_CST);
+        WARN("Unable to create the log thread, messages of the audio threads are not shown\n");
+    }
+}
+
+static void log_stop(void)
+{
+    if (InterlockedDecrement(&logger.users) > 0 || !logger.thread)
+        return;
+    __atomic_store_n(&logger.running, FALSE, __ATOMIC_SEQ_CST);
+    sem_post(&logger.semaphore);
+    WaitForSingleObject(logger.thread, INFINITE);
+    CloseHandle(logger.thread);
+    logger.thread = NULL;
+}
+
+/* errors go to stderr and everything else to stdout, as they always did */
+static void log_print(LONG level, const char *format, ...)
+{
+    va_list     args;
 
-    /* swith asio buffer */
-    This->asio_buffer_index = This->asio_buffer_index ? 0 : 1;
-    return 0;
+    va_start(args, format);
+    vfprintf(level == LogError ? stderr : stdout, format, args);
+    va_end(args);
 }
 
 /*
- * Own sync thread only used to keep both in sync
+ *  Wait-free, called through LOG_RT from the real-time threads. A thread claims a ring with its first
+ *  message, messages of a full ring or of a thread beyond LOG_THREADS are dropped and counted.
  */
-static DWORD WINAPI jack_sync_thread_function(LPVOID arg)
+static inline void log_record(LONG level, const char *format, const LONG *args)
 {
-    struct sched_param param;
+    LogRing         *ring = log_thread_ring;
+    LogRecord       *record;
+    unsigned int    pos;
+    LONG            state;
+    int             i;
 
-    jack_sync_privates.wine_pthread = pthread_self();
+    if (!ring)
+    {
+        for (i = 0; i < LOG_THREADS; i++)
+        {
+            state = LogRingFree;
+            if (__atomic_compare_exchange_n(&logger.rings[i].state, &state, LogRingOwned, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+        }
+        if (i == LOG_THREADS)
+        {
+            __atomic_add_fetch(&logger.unclaimed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        ring = log_thread_ring = &logger.rings[i];
+        __atomic_store_n(&ring->tid, (int) syscall(SYS_gettid), __ATOMIC_RELEASE);
+    }
 
-    // Try to prioritize thread
-    // int max_priority = sched_get_priority_max(SCHED_FIFO);
-    param.sched_priority = 95;
-    pthread_setschedparam(
-        jack_sync_privates.wine_pthread, SCHED_FIFO, &param);
-    
-    while (jack_sync_privates.running == 1) {
-        // wait until jack has called
-        int signal;
-        jack_sync_privates.wine_thread_busy = 0;
-        sigwait(&jack_sync_privates.jack_sig_set, &signal);
-        jack_sync_privates.wine_thread_busy = 1;
-        jack_process_callback_impl(
-            jack_sync_privates.nframes,
-            jack_sync_privates.arg
-        );
-        // Wake the jack thread again
-        pthread_kill(jack_sync_privates.jack_pthread, SIGUSR1);
+    pos = ring->write_pos;
+    if (pos - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
-    return 0;
+    record = &ring->records[pos & (LOG_RING_RECORDS - 1)];
+    record->time = monotonic_ns();
+    record->format = format;
+    record->level = level;
+    for (i = 0; i < LOG_ARGUMENTS; i++)
+        record->args[i] = args[i];
+    __atomic_store_n(&ring->write_pos, pos + 1, __ATOMIC_RELEASE);
+
+    /* only a system call while the log thread sleeps */
+    if (__atomic_load_n(&logger.running, __ATOMIC_RELAXED))
+        sem_post(&logger.semaphore);
 }
 
-
 /*
- * Called from jack, might be a non wine thread
+ *  Print the queued messages oldest first across the rings, then free the rings of threads that exited
  */
-static inline int jack_process_callback(jack_nframes_t nframes, void *arg)
+static void log_flush(void)
 {
-    int signal;
+    LogRing         *ring, *oldest;
+    LogRecord       *record;
+    unsigned int    end[LOG_THREADS];
+    LONG            dropped;
+    int             i, tid, pid = getpid();
 
-    if (jack_sync_privates.wine_thread == NULL)
+    for (i = 0; i < LOG_THREADS; i++)
+        end[i] = __atomic_load_n(&logger.rings[i].write_pos, __ATOMIC_ACQUIRE);
+
+    while (1)
     {
-        // Called from wine thread, just forward the call
-        return jack_process_callback_impl(nframes, arg);
+        oldest = NULL;
+        for (i = 0; i < LOG_THREADS; i++)
+        {
+            ring = &logger.rings[i];
+            if (ring->read_pos != end[i] && (!oldest
+                    || ring->records[ring->read_pos & (LOG_RING_RECORDS - 1)].time < oldest->records[oldest->read_pos & (LOG_RING_RECORDS - 1)].time))
+                oldest = ring;
+        }
+        if (!oldest)
+            break;
+        record = &oldest->records[oldest->read_pos & (LOG_RING_RECORDS - 1)];
+        fprintf(record->level == LogError ? stderr : stdout, record->format,
+                record->args[0], record->args[1], record->args[2], record->args[3]);
+        __atomic_store_n(&oldest->read_pos, oldest->read_pos + 1, __ATOMIC_RELEASE);
     }
-    
-    // if (jack_sync_privates.wine_thread_busy == 1)
-    // {
-    //     ERR("Called busy wine thread");
-    //     return 0;
-    // }
-    // non wine thread, needs to delegated it to proper thread
-    jack_sync_privates.jack_pthread = pthread_self();
-    jack_sync_privates.nframes = nframes;
-    jack_sync_privates.arg = arg;
-    // wake up the wine thread to do the actual processing
-    pthread_kill(jack_sync_privates.wine_pthread, SIGUSR1);
-    
-    // wait until the wine thread is done
-    sigwait(&jack_sync_privates.jack_sig_set, &signal);
-    return 0;
-}
-
-static inline int jack_sample_rate_callback(jack_nframes_t nframes, void *arg)
-{
-    IWineASIOImpl   *This = (IWineASIOImpl*)arg;
 
-    if(This->asio_driver_state != Running)
-        return 0;
+    for (i = 0; i < LOG_THREADS; i++)
+    {
+        ring = &logger.rings[i];
+        if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) != LogRingOwned || !(tid = __atomic_load_n(&ring->tid, __ATOMIC_ACQUIRE)))
+            continue;
+        if ((dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED)) != ring->reported)
+        {
+            LOG(LogDiagnostics, LogWarn, "Log dropped %i messages of thread %i\n", dropped - ring->reported, tid);
+            ring->reported = dropped;
+        }
 
-    This->asio_sample_rate = nframes;
-    This->asio_callbacks->sampleRateDidChange(nframes);
-    return 0;
+        /* a dead thread no longer writes, whatever it left was printed above */
+        if (syscall(SYS_tgkill, pid, tid, 0) < 0 && errno == ESRCH
+                && ring->read_pos == __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE))
+        {
+            ring->tid = 0;
+            ring->read_pos = ring->write_pos = 0;
+            ring->dropped = ring->reported = 0;
+            __atomic_store_n(&ring->state, LogRingFree, __ATOMIC_RELEASE);
+        }
+    }
+    if ((dropped = __atomic_load_n(&logger.unclaimed, __ATOMIC_RELAXED)) != logger.unclaimed_reported)
+    {
+        LOG(LogDiagnostics, LogWarn, "Log dropped %i messages of threads beyond the first %i\n", dropped - logger.unclaimed_reported, LOG_THREADS);
+        logger.unclaimed_reported = dropped;
+    }
+    fflush(stdout);
 }
 
-/*****************************************************************************
- *  Support functions
+/*
+ *  Sleeps until an audio thread queued a message, and prints what is left when the last driver goes
  */
-
-#ifndef WINE_WITH_UNICODE
-/* Funtion required as unicode.h no longer in WINE */
-static WCHAR *strrchrW(const WCHAR* str, WCHAR ch)
+static DWORD WINAPI log_thread_function(LPVOID arg)
 {
-    WCHAR *ret = NULL;
-    do { if (*str == ch) ret = (WCHAR *)(ULONG_PTR)str; } while (*str++);
-    return ret;
+    while (__atomic_load_n(&logger.running, __ATOMIC_SEQ_CST))
+    {
+        sem_wait(&logger.semaphore);
+        log_flush();
+    }
+    log_flush();
+    return 0;
 }
-#endif
 
-/*  
- *  Function called by JACK on jack_activate to create a thread in the wine process context,
- *  uses the global structure jack_thread_creator_privates to communicate with jack_thread_creator_helper()
+/*
+ *  Open the counters of the processing thread as one group, counting user space only so an
+ *  unprivileged process may do it. Counters the machine lacks are left out of the group.
  */
-static int jack_thread_creator(pthread_t* thread_id, const pthread_attr_t* attr, void *(*function)(void*), void* arg)
+static void perf_counters_open(IWineASIOImpl *This, int tid)
 {
-    TRACE("arg: %p, thread_id: %p, attr: %p, function: %p\n", arg, thread_id, attr, function);
+    static const struct { unsigned int type; unsigned long long config; const char *name; } events[CounterCount] =
+    {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache misses" },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN, "minor faults" }
+    };
+    struct perf_event_attr  attr;
+    int                     i;
+
+    This->perf_group = -1;
+    This->perf_members = 0;
+    for (i = 0; i < CounterCount; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.disabled = This->perf_group < 0;
+
+        This->perf_fd[i] = syscall(SYS_perf_event_open, &attr, tid, -1, This->perf_group, PERF_FLAG_FD_CLOEXEC);
+        This->perf_slot[i] = This->perf_fd[i] < 0 ? -1 : This->perf_members++;
+        if (This->perf_fd[i] < 0)
+        {
+            LOG(LogDiagnostics, LogWarn, "Unable to count %s: %s\n", events[i].name, strerror(errno));
+        }
+        else if (This->perf_group < 0)
+            This->perf_group = This->perf_fd[i];
+    }
+    if (This->perf_group < 0)
+        return;
 
-    jack_thread_creator_privates.jack_callback_thread = function;
-    jack_thread_creator_privates.arg = arg;
-    jack_thread_creator_privates.jack_callback_thread_created = CreateEventW(NULL, FALSE, FALSE, NULL);
-    CreateThread(NULL, 0, jack_thread_creator_helper, arg, 0, 0); // We jump into jack_thread_creator_helper now
-    // Now we wait until jack_thread_creator_helper is finished and has revealed the thread id
-    WaitForSingleObject(jack_thread_creator_privates.jack_callback_thread_created, INFINITE);
-    // Now we know the thread id an can pass it back to jack
-    *thread_id = jack_thread_creator_privates.jack_callback_pthread_id;
-    return 0;
+    ioctl(This->perf_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    __atomic_store_n(&This->perf_tid, tid, __ATOMIC_RELEASE);
+    TRACE("Counting %i performance counters of thread %i\n", This->perf_members, tid);
 }
 
-/*
- *  internal helper function for returning the posix thread_id of the newly created callback thread
- *  This basically wraps jack_process_callback, no idea where it's called from yet
- */
-static DWORD WINAPI jack_thread_creator_helper(LPVOID arg)
+/* the processing thread stops reading before the descriptors go away */
+static void perf_counters_close(IWineASIOImpl *This)
 {
-    TRACE("arg: %p\n", arg);
-    // write the id in the shared data
-    jack_thread_creator_privates.jack_callback_pthread_id = pthread_self();
-    // notify the main thread
-    SetEvent(jack_thread_creator_privates.jack_callback_thread_created);
-    // This results in a call to jack_process_callback
-    jack_thread_creator_privates.jack_callback_thread(jack_thread_creator_privates.arg);
-    return 0;
+    int     i;
+
+    __atomic_store_n(&This->perf_tid, 0, __ATOMIC_SEQ_CST);
+    for (i = 0; i < CounterCount; i++)
+    {
+        if (This->perf_fd[i] >= 0)
+            close(This->perf_fd[i]);
+        This->perf_fd[i] = This->perf_slot[i] = -1;
+    }
+    This->perf_group = -1;
+    This->perf_members = 0;
 }
 
 static VOID configure_driver(IWineASIOImpl *This)
@@ -1506,6 +4801,13 @@ static VOID configure_driver(IWineASIOImpl *This)
     WCHAR   application_path [MAX_PATH];
     WCHAR   *application_name;
     char    environment_variable[MAX_ENVIRONMENT_SIZE];
+    WCHAR   routing[MAX_ROUTING_LENGTH];
+    char    routing_variable[MAX_ROUTING_LENGTH];
+    WCHAR   trace_file[MAX_PATH];
+    char    trace_variable[MAX_PATH];
+    WCHAR   log_level[MAX_LOG_LENGTH];
+    char    log_variable[MAX_LOG_LENGTH];
+    int     i;
 
     /* Unicode strings used for the registry */
     static const WCHAR key_software_wine_wineasio[] =
@@ -1516,6 +4818,10 @@ static VOID configure_driver(IWineASIOImpl *This)
         { 'N','u','m','b','e','r',' ','o','f',' ','i','n','p','u','t','s',0 };
     static const WCHAR value_wineasio_number_outputs[] =
         { 'N','u','m','b','e','r',' ','o','f',' ','o','u','t','p','u','t','s',0 };
+    static const WCHAR value_wineasio_number_loopbacks[] =
+        { 'N','u','m','b','e','r',' ','o','f',' ','l','o','o','p','b','a','c','k','s',0 };
+    static const WCHAR value_wineasio_loopback_source[] =
+        { 'L','o','o','p','b','a','c','k',' ','s','o','u','r','c','e',0 };
     static const WCHAR value_wineasio_fixed_buffersize[] =
         { 'F','i','x','e','d',' ','b','u','f','f','e','r','s','i','z','e',0 };
     static const WCHAR value_wineasio_preferred_buffersize[] =
@@ -1524,6 +4830,26 @@ static VOID configure_driver(IWineASIOImpl *This)
         { 'A','u','t','o','s','t','a','r','t',' ','s','e','r','v','e','r',0 };
     static const WCHAR value_wineasio_connect_to_hardware[] =
         { 'C','o','n','n','e','c','t',' ','t','o',' ','h','a','r','d','w','a','r','e',0 };
+    static const WCHAR value_wineasio_decoupled_buffersize[] =
+        { 'D','e','c','o','u','p','l','e','d',' ','b','u','f','f','e','r','s','i','z','e',0 };
+    static const WCHAR value_wineasio_async_periods[] =
+        { 'A','s','y','n','c','h','r','o','n','o','u','s',' ','p','e','r','i','o','d','s',0 };
+    static const WCHAR value_wineasio_resampling[] =
+        { 'R','e','s','a','m','p','l','i','n','g',0 };
+    static const WCHAR value_wineasio_input_routing[] =
+        { 'I','n','p','u','t',' ','r','o','u','t','i','n','g',0 };
+    static const WCHAR value_wineasio_output_routing[] =
+        { 'O','u','t','p','u','t',' ','r','o','u','t','i','n','g',0 };
+    static const WCHAR value_wineasio_performance_counters[] =
+        { 'P','e','r','f','o','r','m','a','n','c','e',' ','c','o','u','n','t','e','r','s',0 };
+    static const WCHAR value_wineasio_interpolate_position[] =
+        { 'I','n','t','e','r','p','o','l','a','t','e',' ','p','o','s','i','t','i','o','n',0 };
+    static const WCHAR value_wineasio_trace_file[] =
+        { 'T','r','a','c','e',' ','f','i','l','e',0 };
+    static const WCHAR value_wineasio_log_level[] =
+        { 'L','o','g',' ','l','e','v','e','l',0 };
+    static const WCHAR default_log_level[] =
+        { 'w','a','r','n',0 };
 
     /* Initialise most member variables,
      * asio_sample_position, asio_time, & asio_time_stamp are initialized in Start()
@@ -1532,6 +4858,11 @@ static VOID configure_driver(IWineASIOImpl *This)
     This->asio_active_outputs = 0;
     This->asio_buffer_index = 0;
     This->asio_callbacks = NULL;
+    This->asio_can_buffer_size_change = FALSE;
+    This->asio_can_latencies_changed = FALSE;
+    This->asio_can_overload = FALSE;
+    This->asio_can_reset_request = FALSE;
+    This->asio_can_resync_request = FALSE;
     This->asio_can_time_code = FALSE;
     This->asio_current_buffersize = 0;
     This->asio_driver_state = Loaded;
@@ -1541,18 +4872,69 @@ static VOID configure_driver(IWineASIOImpl *This)
 
     This->wineasio_number_inputs = 16;
     This->wineasio_number_outputs = 16;
+    This->wineasio_number_loopbacks = 0;
+    This->wineasio_loopback_source = 0;
     This->wineasio_autostart_server = FALSE;
     This->wineasio_connect_to_hardware = TRUE;
     This->wineasio_fixed_buffersize = TRUE;
     This->wineasio_preferred_buffersize = ASIO_PREFERRED_BUFFERSIZE;
+    This->wineasio_decoupled_buffersize = FALSE;
+    This->wineasio_async_periods = 0;
+    This->wineasio_resampling = FALSE;
+    This->wineasio_performance_counters = FALSE;
+    This->wineasio_interpolate_position = FALSE;
+    This->wineasio_input_routing[0] = 0;
+    This->wineasio_output_routing[0] = 0;
+    This->wineasio_trace_file[0] = 0;
+    strcpy(This->wineasio_log_level, "warn");
 
     This->jack_client = NULL;
     This->jack_client_name[0] = 0;
+    This->jack_buffersize = 0;
+    This->jack_sample_rate = 0;
     This->jack_input_ports = NULL;
     This->jack_output_ports = NULL;
     This->callback_audio_buffer = NULL;
     This->input_channel = NULL;
     This->output_channel = NULL;
+    This->period_adapter = NULL;
+    This->input_routing = NULL;
+    This->output_routing = NULL;
+    This->pending_adapter = NULL;
+    This->retired_adapter = NULL;
+    This->adapter_reset_pending = FALSE;
+    This->adapter_input_latency = This->adapter_output_latency = 0;
+    This->output_ready_armed = This->output_ready_done = FALSE;
+    This->event_thread = NULL;
+    This->event_thread_id = 0;
+    This->event_running = FALSE;
+    This->event_thread_retired = NULL;
+    This->event_thread_retired_id = 0;
+    This->event_pending = 0;
+    This->async_thread = NULL;
+    This->async_thread_id = 0;
+    This->async_running = FALSE;
+    This->async_busy = FALSE;
+    This->statistics = NULL;
+    This->shared = NULL;
+    This->shared_path[0] = 0;
+    This->shared_metering = FALSE;
+    This->trace = NULL;
+    for (i = 0; i < CounterCount; i++)
+        This->perf_fd[i] = This->perf_slot[i] = -1;
+    This->perf_group = -1;
+    This->perf_members = 0;
+    This->perf_tid = This->perf_request_tid = 0;
+    This->perf_active = FALSE;
+    This->cycle_frame_time_valid = FALSE;
+    This->clock_valid = FALSE;
+    This->position.sequence = 0;
+    This->transport_locate = 0;
+    This->transport_located = 0;
+    This->transport_frame = This->transport_nframes = 0;
+    This->transport_rolling = FALSE;
+    This->transport_resync = TRUE;
+    This->position.position = This->position.system_time = 0;
 
     /* create registry entries with defaults if not present */
     result = RegCreateKeyExW(HKEY_CURRENT_USER, key_software_wine_wineasio, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hkey, NULL);
@@ -1587,6 +4969,36 @@ static VOID configure_driver(IWineASIOImpl *This)
         result = RegSetValueExW(hkey, value_wineasio_number_outputs, 0, REG_DWORD, (LPBYTE) &value, size);
     }
 
+    /* get/set number of loopback inputs */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_number_loopbacks, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_number_loopbacks = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_number_loopbacks;
+        result = RegSetValueExW(hkey, value_wineasio_number_loopbacks, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set the first output recorded by the loopback inputs */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_loopback_source, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_loopback_source = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_loopback_source;
+        result = RegSetValueExW(hkey, value_wineasio_loopback_source, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
     /* allow changing of asio buffer sizes */
     size = sizeof(DWORD);
     if (RegQueryValueExW(hkey, value_wineasio_fixed_buffersize, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
@@ -1647,6 +5059,135 @@ static VOID configure_driver(IWineASIOImpl *This)
         result = RegSetValueExW(hkey, value_wineasio_connect_to_hardware, 0, REG_DWORD, (LPBYTE) &value, size);
     }
 
+    /* get/set decoupling of the asio buffer size from the JACK period */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_decoupled_buffersize, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_decoupled_buffersize = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_decoupled_buffersize;
+        result = RegSetValueExW(hkey, value_wineasio_decoupled_buffersize, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set number of buffers the host may run behind JACK */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_async_periods, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_async_periods = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_async_periods;
+        result = RegSetValueExW(hkey, value_wineasio_async_periods, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set sample rate conversion for hosts that want another rate than JACK */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_resampling, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_resampling = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_resampling;
+        result = RegSetValueExW(hkey, value_wineasio_resampling, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set counting cycles, instructions, cache misses and page faults of every period */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_performance_counters, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_performance_counters = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_performance_counters;
+        result = RegSetValueExW(hkey, value_wineasio_performance_counters, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set running the sample position on between buffers */
+    size = sizeof(DWORD);
+    if (RegQueryValueExW(hkey, value_wineasio_interpolate_position, NULL, &type, (LPBYTE) &value, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_DWORD)
+            This->wineasio_interpolate_position = value;
+    }
+    else
+    {
+        type = REG_DWORD;
+        size = sizeof(DWORD);
+        value = This->wineasio_interpolate_position;
+        result = RegSetValueExW(hkey, value_wineasio_interpolate_position, 0, REG_DWORD, (LPBYTE) &value, size);
+    }
+
+    /* get/set the routing matrices, empty keeps one JACK port per ASIO channel */
+    size = sizeof(routing);
+    if (RegQueryValueExW(hkey, value_wineasio_input_routing, NULL, &type, (LPBYTE) routing, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_SZ)
+            WideCharToMultiByte(CP_ACP, 0, routing, -1, This->wineasio_input_routing, MAX_ROUTING_LENGTH, NULL, NULL);
+    }
+    else
+    {
+        type = REG_SZ;
+        routing[0] = 0;
+        result = RegSetValueExW(hkey, value_wineasio_input_routing, 0, REG_SZ, (LPBYTE) routing, sizeof(WCHAR));
+    }
+
+    size = sizeof(routing);
+    if (RegQueryValueExW(hkey, value_wineasio_output_routing, NULL, &type, (LPBYTE) routing, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_SZ)
+            WideCharToMultiByte(CP_ACP, 0, routing, -1, This->wineasio_output_routing, MAX_ROUTING_LENGTH, NULL, NULL);
+    }
+    else
+    {
+        type = REG_SZ;
+        routing[0] = 0;
+        result = RegSetValueExW(hkey, value_wineasio_output_routing, 0, REG_SZ, (LPBYTE) routing, sizeof(WCHAR));
+    }
+
+    /* get/set the trace file, a unix path, empty does not trace */
+    size = sizeof(trace_file);
+    if (RegQueryValueExW(hkey, value_wineasio_trace_file, NULL, &type, (LPBYTE) trace_file, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_SZ)
+            WideCharToMultiByte(CP_ACP, 0, trace_file, -1, This->wineasio_trace_file, MAX_PATH, NULL, NULL);
+    }
+    else
+    {
+        type = REG_SZ;
+        trace_file[0] = 0;
+        result = RegSetValueExW(hkey, value_wineasio_trace_file, 0, REG_SZ, (LPBYTE) trace_file, sizeof(WCHAR));
+    }
+
+    /* get/set the log levels, one for all categories and/or category=level pairs */
+    size = sizeof(log_level);
+    if (RegQueryValueExW(hkey, value_wineasio_log_level, NULL, &type, (LPBYTE) log_level, &size) == ERROR_SUCCESS)
+    {
+        if (type == REG_SZ)
+            WideCharToMultiByte(CP_ACP, 0, log_level, -1, This->wineasio_log_level, MAX_LOG_LENGTH, NULL, NULL);
+    }
+    else
+    {
+        type = REG_SZ;
+        result = RegSetValueExW(hkey, value_wineasio_log_level, 0, REG_SZ, (LPBYTE) default_log_level, sizeof(default_log_level));
+    }
+
     /* get client name by stripping path and extension */
     GetModuleFileNameW(0, application_path, MAX_PATH);
     application_name = strrchrW(application_path, L'.');
@@ -1675,6 +5216,22 @@ static VOID configure_driver(IWineASIOImpl *This)
             This->wineasio_number_outputs = result;
     }
 
+    if (GetEnvironmentVariableA("WINEASIO_NUMBER_LOOPBACKS", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        errno = 0;
+        result = strtol(environment_variable, 0, 10);
+        if (errno != ERANGE)
+            This->wineasio_number_loopbacks = result;
+    }
+
+    if (GetEnvironmentVariableA("WINEASIO_LOOPBACK_SOURCE", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        errno = 0;
+        result = strtol(environment_variable, 0, 10);
+        if (errno != ERANGE)
+            This->wineasio_loopback_source = result;
+    }
+
     if (GetEnvironmentVariableA("WINEASIO_AUTOSTART_SERVER", environment_variable, MAX_ENVIRONMENT_SIZE))
     {
         if (!strcasecmp(environment_variable, "on"))
@@ -1699,6 +5256,46 @@ static VOID configure_driver(IWineASIOImpl *This)
             This->wineasio_fixed_buffersize = FALSE;
     }
 
+    if (GetEnvironmentVariableA("WINEASIO_DECOUPLED_BUFFERSIZE", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        if (!strcasecmp(environment_variable, "on"))
+            This->wineasio_decoupled_buffersize = TRUE;
+        else if (!strcasecmp(environment_variable, "off"))
+            This->wineasio_decoupled_buffersize = FALSE;
+    }
+
+    if (GetEnvironmentVariableA("WINEASIO_ASYNC_PERIODS", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        errno = 0;
+        result = strtol(environment_variable, 0, 10);
+        if (errno != ERANGE)
+            This->wineasio_async_periods = result;
+    }
+
+    if (GetEnvironmentVariableA("WINEASIO_RESAMPLING", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        if (!strcasecmp(environment_variable, "on"))
+            This->wineasio_resampling = TRUE;
+        else if (!strcasecmp(environment_variable, "off"))
+            This->wineasio_resampling = FALSE;
+    }
+
+    if (GetEnvironmentVariableA("WINEASIO_PERFORMANCE_COUNTERS", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        if (!strcasecmp(environment_variable, "on"))
+            This->wineasio_performance_counters = TRUE;
+        else if (!strcasecmp(environment_variable, "off"))
+            This->wineasio_performance_counters = FALSE;
+    }
+
+    if (GetEnvironmentVariableA("WINEASIO_INTERPOLATE_POSITION", environment_variable, MAX_ENVIRONMENT_SIZE))
+    {
+        if (!strcasecmp(environment_variable, "on"))
+            This->wineasio_interpolate_position = TRUE;
+        else if (!strcasecmp(environment_variable, "off"))
+            This->wineasio_interpolate_position = FALSE;
+    }
+
     if (GetEnvironmentVariableA("WINEASIO_PREFERRED_BUFFERSIZE", environment_variable, MAX_ENVIRONMENT_SIZE))
     {
         errno = 0;
@@ -1707,6 +5304,23 @@ static VOID configure_driver(IWineASIOImpl *This)
             This->wineasio_preferred_buffersize = result;
     }
 
+    size = GetEnvironmentVariableA("WINEASIO_INPUT_ROUTING", routing_variable, MAX_ROUTING_LENGTH);
+    if (size > 0 && size < MAX_ROUTING_LENGTH)
+        strcpy(This->wineasio_input_routing, routing_variable);
+
+    size = GetEnvironmentVariableA("WINEASIO_OUTPUT_ROUTING", routing_variable, MAX_ROUTING_LENGTH);
+    if (size > 0 && size < MAX_ROUTING_LENGTH)
+        strcpy(This->wineasio_output_routing, routing_variable);
+
+    size = GetEnvironmentVariableA("WINEASIO_TRACE_FILE", trace_variable, MAX_PATH);
+    if (size > 0 && size < MAX_PATH)
+        strcpy(This->wineasio_trace_file, trace_variable);
+
+    size = GetEnvironmentVariableA("WINEASIO_LOG_LEVEL", log_variable, MAX_LOG_LENGTH);
+    if (size > 0 && size < MAX_LOG_LENGTH)
+        strcpy(This->wineasio_log_level, log_variable);
+    log_configure(This->wineasio_log_level);
+
     /* over ride the JACK client name gotten from the application name */
     size = GetEnvironmentVariableA("WINEASIO_CLIENT_NAME", environment_variable, ASIO_MAX_NAME_LENGTH);
     if (size > 0 && size < ASIO_MAX_NAME_LENGTH)
@@ -1718,6 +5332,14 @@ static VOID configure_driver(IWineASIOImpl *This)
             && This->wineasio_preferred_buffersize <= ASIO_MAXIMUM_BUFFERSIZE))
         This->wineasio_preferred_buffersize = ASIO_PREFERRED_BUFFERSIZE;
 
+    /* every loopback input needs an output to record */
+    if (This->wineasio_loopback_source < 0 || This->wineasio_loopback_source >= This->wineasio_number_outputs)
+        This->wineasio_loopback_source = 0;
+    if (This->wineasio_number_loopbacks < 0)
+        This->wineasio_number_loopbacks = 0;
+    if (This->wineasio_number_loopbacks > This->wineasio_number_outputs - This->wineasio_loopback_source)
+        This->wineasio_number_loopbacks = This->wineasio_number_outputs - This->wineasio_loopback_source;
+
     return;
 }
 
@@ -1728,12 +5350,15 @@ HRESULT WINAPI WineASIOCreateInstance(REFIID riid, LPVOID *ppobj)
 
     /* TRACE("riid: %s, ppobj: %p\n", debugstr_guid(riid), ppobj); */
 
-    pobj = HeapAlloc(GetProcessHeap(), 0, sizeof(*pobj));
+    /* the heap only aligns to 16 bytes, the real-time fields need whole cache lines */
+    if (posix_memalign((void **) &pobj, CACHE_LINE_SIZE, sizeof(*pobj)))
+        pobj = NULL;
     if (pobj == NULL)
     {
         WARN("out of memory\n");
         return E_OUTOFMEMORY;
     }
+    memset(pobj, 0, sizeof(*pobj));
 
     pobj->lpVtbl = &WineASIO_Vtbl;
     pobj->ref = 1;
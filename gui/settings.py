@@ -18,11 +18,15 @@
 
 # ---------------------------------------------------------------------------------------------------------------------
 
+import glob
+import mmap
 import os
+import struct
 import sys
 
-from PyQt5.QtCore import pyqtSlot, QDir
-from PyQt5.QtWidgets import QApplication, QDialog, QDialogButtonBox
+from PyQt5.QtCore import pyqtSlot, QDir, QTimer
+from PyQt5.QtWidgets import QApplication, QDialog, QDialogButtonBox, QComboBox, QLabel, QProgressBar
+from PyQt5.QtWidgets import QGridLayout, QVBoxLayout
 
 # ---------------------------------------------------------------------------------------------------------------------
 
@@ -40,6 +44,27 @@ if not WINEPREFIX:
 
 WINEASIO_PREFIX = "HKEY_CURRENT_USER\Software\Wine\WineASIO"
 
+# Live statistics published by every driver instance, see SharedStatistics in asio.c
+STATS_GLOB    = "/dev/shm/wineasio-*"
+STATS_MAGIC   = 0x4f495341
+STATS_VERSION = 3
+STATS_HEADER  = struct.Struct("<5Ii32s10iQQ")
+STATS_COUNTS  = struct.Struct("<4iQ")
+STATS_COSTS   = struct.Struct("<30i2i")
+STATS_COUNTER = struct.Struct("<9Q")
+STATS_CLOCK   = struct.Struct("<2i")
+STATS_METER   = struct.Struct("<3i")
+STATS_FLAG    = struct.Struct("<i")
+
+# offsets of the fields a reader writes, metering in the header and the peak of a meter
+STATS_METERING_OFFSET = 92
+STATS_PEAK_OFFSET     = 4
+
+HISTOGRAM_BUCKETS = 124
+TIMING_NAMES      = ("wake", "input", "host", "output", "cycle")
+STATE_NAMES       = ("Loaded", "Initialized", "Prepared", "Running")
+COUNTER_NAMES     = ("cycles", "instructions", "cache misses", "minor faults")
+
 # ---------------------------------------------------------------------------------------------------------------------
 
 def getWineASIOKeyValue(key: str, default: str):
@@ -75,6 +100,235 @@ def smartHex(value: str, length: int):
 
   return hexStr
 
+def findWineASIOStats():
+    stats = []
+
+    for path in sorted(glob.glob(STATS_GLOB)):
+        try:
+            pid = int(os.path.basename(path).split("-")[1])
+            os.kill(pid, 0)
+        except (ValueError, IndexError, ProcessLookupError):
+            continue
+        except PermissionError:
+            pass
+        stats.append(path)
+
+    return stats
+
+def openWineASIOStats(path: str):
+    with open(path, "r+b") as fh:
+        return mmap.mmap(fh.fileno(), 0)
+
+# Durations in nanoseconds that a fraction of the histogram counts stay below
+def histogramPercentile(counts, fraction: float):
+    total = sum(counts)
+
+    if total == 0:
+        return 0
+
+    seen = 0
+    for bucket in range(len(counts)):
+        seen += counts[bucket]
+        if seen >= total * fraction:
+            break
+
+    # upper end of the bucket, see histogram_add() in asio.c
+    if bucket < 4:
+        return bucket + 1
+    return (5 + bucket % 4) << (bucket // 4 - 1)
+
+def readWineASIOStats(block):
+    (magic, version, size, statsOffset, meterOffset, pid, name,
+     state, asioBufferSize, jackBufferSize, asioRate, jackRate,
+     numInputs, numOutputs, activeInputs, activeOutputs, metering,
+     cycles, position) = STATS_HEADER.unpack_from(block, 0)
+
+    if magic != STATS_MAGIC or version != STATS_VERSION:
+        return None
+
+    xruns, missed, late, discontinuities, discontinuityPosition = STATS_COUNTS.unpack_from(block, statsOffset)
+    timingOffset = statsOffset + STATS_COUNTS.size
+    costOffset   = timingOffset + len(TIMING_NAMES) * HISTOGRAM_BUCKETS * 4
+    costs        = STATS_COSTS.unpack_from(block, costOffset)
+    counters     = STATS_COUNTER.unpack_from(block, costOffset + STATS_COSTS.size)
+    counted      = max(counters[8], 1)
+    clockRate, clockDrift = STATS_CLOCK.unpack_from(block, costOffset + STATS_COSTS.size + STATS_COUNTER.size)
+
+    stats = {
+        "pid": pid,
+        "name": name.split(b"\0")[0].decode("utf-8", "replace"),
+        "state": STATE_NAMES[state] if 0 <= state < len(STATE_NAMES) else str(state),
+        "asioBufferSize": asioBufferSize,
+        "jackBufferSize": jackBufferSize,
+        "asioRate": asioRate,
+        "jackRate": jackRate,
+        "activeInputs": activeInputs,
+        "activeOutputs": activeOutputs,
+        "metering": metering,
+        "meterOffset": meterOffset,
+        "cycles": cycles,
+        "position": position,
+        "xruns": xruns,
+        "missedDeadlines": missed,
+        "lateCallbacks": late,
+        "discontinuities": discontinuities,
+        "budget": costs[31],
+        "countedCycles": counters[8],
+        "clockRate": clockRate / 1000.0,
+        "clockDrift": clockDrift / 1000.0,
+        # per cycle averages outside and inside of bufferSwitch
+        "counters": dict((COUNTER_NAMES[i], (counters[i] // counted, counters[4 + i] // counted))
+                         for i in range(len(COUNTER_NAMES))),
+        "timing": {},
+        "cost": {},
+        "inputs": [],
+        "outputs": [],
+    }
+
+    for i in range(len(TIMING_NAMES)):
+        counts = struct.unpack_from("<%ii" % HISTOGRAM_BUCKETS, block, timingOffset + i * HISTOGRAM_BUCKETS * 4)
+        stats["timing"][TIMING_NAMES[i]] = (histogramPercentile(counts, 0.5), histogramPercentile(counts, 0.99))
+        # wall average and maximum, cpu average and maximum
+        stats["cost"][TIMING_NAMES[i]] = costs[i * 6:i * 6 + 4]
+
+    for i in range(numInputs + numOutputs):
+        meter = STATS_METER.unpack_from(block, meterOffset + i * STATS_METER.size)
+        stats["inputs" if i < numInputs else "outputs"].append(meter)
+
+    return stats
+
+# ---------------------------------------------------------------------------------------------------------------------
+# Live statistics of the running driver instances
+
+class WineASIOMonitorDialog(QDialog):
+    def __init__(self, parent):
+        QDialog.__init__(self, parent)
+        self.setWindowTitle("WineASIO Monitor")
+        self.resize(480, 420)
+
+        self.block  = None
+        self.meters = []
+
+        self.cb_instance = QComboBox(self)
+        self.label_stats = QLabel(self)
+        self.layout_meters = QGridLayout()
+
+        layout = QVBoxLayout(self)
+        layout.addWidget(self.cb_instance)
+        layout.addWidget(self.label_stats)
+        layout.addLayout(self.layout_meters)
+        layout.addStretch()
+
+        self.cb_instance.currentIndexChanged[int].connect(self.slot_instanceChanged)
+
+        self.timer = QTimer(self)
+        self.timer.timeout.connect(self.slot_refresh)
+        self.timer.start(250)
+
+        self.findInstances()
+
+    def findInstances(self):
+        self.cb_instance.blockSignals(True)
+        current = self.cb_instance.currentText()
+        self.cb_instance.clear()
+        for path in findWineASIOStats():
+            self.cb_instance.addItem(path)
+            if path == current:
+                self.cb_instance.setCurrentIndex(self.cb_instance.count()-1)
+        self.cb_instance.blockSignals(False)
+
+        if self.cb_instance.currentText() != current or self.block is None:
+            self.slot_instanceChanged(self.cb_instance.currentIndex())
+
+    def clearMeters(self):
+        for label, bar in self.meters:
+            label.deleteLater()
+            bar.deleteLater()
+        self.meters = []
+
+    @pyqtSlot(int)
+    def slot_instanceChanged(self, index: int):
+        if self.block is not None:
+            self.block.close()
+        self.block = None
+        self.clearMeters()
+
+        if index < 0:
+            self.label_stats.setText("No running WineASIO instance found")
+            return
+
+        try:
+            self.block = openWineASIOStats(self.cb_instance.itemText(index))
+        except OSError as e:
+            self.label_stats.setText(str(e))
+            return
+
+        # ask the driver to meter every channel
+        STATS_FLAG.pack_into(self.block, STATS_METERING_OFFSET, 1)
+
+    @pyqtSlot()
+    def slot_refresh(self):
+        if self.block is None or not os.path.exists(self.cb_instance.currentText()):
+            self.findInstances()
+            return
+
+        stats = readWineASIOStats(self.block)
+        if stats is None:
+            return
+
+        text  = "%s, pid %i, %s\n" % (stats["name"], stats["pid"], stats["state"])
+        text += "ASIO %i frames at %i Hz, JACK %i frames at %i Hz\n" % (stats["asioBufferSize"], stats["asioRate"],
+                                                                       stats["jackBufferSize"], stats["jackRate"])
+        text += "%i inputs and %i outputs active, %i cycles\n\n" % (stats["activeInputs"], stats["activeOutputs"],
+                                                                    stats["cycles"])
+        text += "xruns %i, missed deadlines %i, late callbacks %i, discontinuities %i\n" % (
+            stats["xruns"], stats["missedDeadlines"], stats["lateCallbacks"], stats["discontinuities"])
+        text += "cycle budget %i us\n" % (stats["budget"] // 1000)
+        if stats["clockRate"]:
+            text += "measured clock %.3f Hz, drift %+.3f ppm\n" % (stats["clockRate"], stats["clockDrift"])
+        for name in TIMING_NAMES:
+            median, high = stats["timing"][name]
+            wallAverage, wallMaximum, cpuAverage, cpuMaximum = stats["cost"][name]
+            text += "%-7s median %6i us, 99%% %6i us, average %6i us, maximum %6i us\n" % (
+                name, median // 1000, high // 1000, wallAverage // 1000, wallMaximum // 1000)
+        if stats["countedCycles"]:
+            text += "per cycle driver/host %s\n" % ", ".join("%s %i/%i" % (name, stats["counters"][name][0], stats["counters"][name][1])
+                                                            for name in COUNTER_NAMES)
+        self.label_stats.setText(text)
+
+        self.refreshMeters(stats)
+
+    def refreshMeters(self, stats):
+        channels = [("in %i" % (i + 1), stats["inputs"][i], i) for i in range(len(stats["inputs"]))]
+        channels += [("out %i" % (i + 1), stats["outputs"][i], len(stats["inputs"]) + i)
+                     for i in range(len(stats["outputs"]))]
+        channels = [channel for channel in channels if channel[1][0]]
+
+        if len(channels) != len(self.meters):
+            self.clearMeters()
+            for row in range(len(channels)):
+                label = QLabel(channels[row][0], self)
+                bar   = QProgressBar(self)
+                bar.setRange(0, 0x7fff)
+                bar.setTextVisible(False)
+                self.layout_meters.addWidget(label, row, 0)
+                self.layout_meters.addWidget(bar, row, 1)
+                self.meters.append((label, bar))
+
+        for row in range(len(channels)):
+            name, (active, peak, rms), index = channels[row]
+            self.meters[row][0].setText(name)
+            self.meters[row][1].setValue(peak >> 16)
+            # the peak holds until it is read, start the next one
+            STATS_FLAG.pack_into(self.block, stats["meterOffset"] + index * STATS_METER.size + STATS_PEAK_OFFSET, 0)
+
+    def done(self, result: int):
+        self.timer.stop()
+        if self.block is not None:
+            self.block.close()
+            self.block = None
+        QDialog.done(self, result)
+
 # ---------------------------------------------------------------------------------------------------------------------
 # Set-up GUI (Tweaks, WineASIO)
 
@@ -96,6 +350,9 @@ class WineASIOSettingsDialog(QDialog, Ui_WineASIOSettings):
         self.cb_jack_fixed_bsize.clicked.connect(self.slot_flagChanged)
         self.cb_jack_buffer_size.currentIndexChanged[int].connect(self.slot_flagChanged)
 
+        self.b_monitor = self.buttonBox.addButton("Monitor", QDialogButtonBox.ActionRole)
+        self.b_monitor.clicked.connect(self.slot_showMonitor)
+
     def loadSettings(self):
         ins  = int(getWineASIOKeyValue("Number of inputs", "00000010"), 16)
         outs = int(getWineASIOKeyValue("Number of outputs", "00000010"), 16)
@@ -121,6 +378,10 @@ class WineASIOSettingsDialog(QDialog, Ui_WineASIOSettings):
     def slot_flagChanged(self):
         self.changed = True
 
+    @pyqtSlot()
+    def slot_showMonitor(self):
+        WineASIOMonitorDialog(self).exec_()
+
     @pyqtSlot()
     def slot_restoreDefaults(self):
         self.changed = True